@@ -14,23 +14,692 @@
 #include "imgcomp.h"
 #include "config.h"
 
-int NewestAverageBright;
+static TriggerInfo_t AnalyzeDifferences(CompareContext_t * Ctx, Region_t Region, int threshold, int UpdateFatigue, int SubtractFatigue, TriggerList_t * no_fatigue_motion);
+static int RecheckLocal(CompareContext_t * Ctx, MemImage_t * pic1, MemImage_t * pic2, Region_t Region,
+        int DetectionPixels, int m1i, int m2i, double BrightnessRatio, TriggerInfo_t Around, TriggerInfo_t * Result);
+static TriggerInfo_t FatigueAndLocate(CompareContext_t * Ctx, int UpdateFatigue, int SkipFatigue, TriggerList_t * no_fatigue_motion);
+static void FreeSizedMaps(CompareContext_t * Ctx);
+static MemImage_t * MakeCoarse(CompareContext_t * Ctx, MemImage_t * pic, Region_t MainReg, FrameFeatures_t * feat);
+static int CoarseCompare(CompareContext_t * Ctx, FrameFeatures_t * feat1, FrameFeatures_t * feat2,
+        Region_t MainReg, int m1i, int m2i, double BrightnessRatio,
+        TriggerList_t * no_fatigue_motion, int Percent, TriggerInfo_t * Result);
+static ImgMap_t * GetCellWeight(CompareContext_t * Ctx, Region_t MainReg);
+static void AllocScaledMaps(CompareContext_t * Ctx);
+static void ScaleDifferences(CompareContext_t * Ctx, ImgMap_t * DiffScaled, Region_t Region, int threshold, int * Hist);
+static TriggerInfo_t LocateMotion(CompareContext_t * Ctx, ImgMap_t * DiffScaled, TriggerList_t * Objects);
 
-static ImgMap_t * DiffVal = NULL;
-ImgMap_t * WeightMap = NULL;
 
-static TriggerInfo_t AnalyzeDifferences(Region_t Region, int threshold, int UpdateFatigue, int SubtractFatigue, TriggerInfo_t * no_fatigue_motion);
+//----------------------------------------------------------------------------------------
+// Compute differences for one row of pixels.  This is the reference version of the
+// difference kernel.  The SIMD versions in compare_simd.c must produce identical results.
+// Only called for runs of pixels that are in the weight map.
+// pd, if not NULL, is where to put the difference image for debugging.
+//----------------------------------------------------------------------------------------
+void DiffRowScalar(const unsigned char * p1, const unsigned char * p2,
+        int n, int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd)
+{
+    for (int col=0;col<n;col++){
+        // Data is in order red, green, blue.
+        int dr,dg,db;
+        int dcomp;
+        int max;
+        {
+            // Find maximum of red green or blue for either picture after adjustment.
+            int max1, max2;
+            max1 = p1[0];
+            if (p1[1] > max1) max1 = p1[1];
+            if (p1[2] > max1) max1 = p1[2];
+            max1 *= m1i;
+            max2 = p2[0];
+            if (p2[1] > max1) max1 = p2[1];
+            if (p2[2] > max1) max1 = p2[2];
+            max2 *= m2i;
+            max = max2 > max1 ? max2 : max1;
+            max = max >> 8;
+            if (max < 40) max = 40; // Don't allow under 40 to avoid amlifying dark noise.
+        }
+
+        // Compute red green and blue differences
+        dr = (p1[0]*m1i - p2[0]*m2i);
+        dg = (p1[1]*m1i - p2[1]*m2i);
+        db = (p1[2]*m1i - p2[2]*m2i);
+
+        // Make differences absolute values.
+        if (dr < 0) dr = -dr;
+        if (dg < 0) dg = -dg;
+        if (db < 0) db = -db;
+
+        // compute composite difference.
+        dcomp = (dr + dg*2 + db) >> 8; // Put more emphasis on green
+        dcomp = dcomp * 120/max;       // Normalize difference to local brightness.
+
+
+        // Add computed difference value to histogram bins.
+        if (dcomp >= 256) dcomp = 255;
+        if (dcomp < 0){
+            fprintf(stderr,"Internal error dcomp\n");
+            dcomp = 0;
+        }
+        DiffHist[dcomp] += 1;
+        diffrow[col] = dcomp;
+
+        if (pd){
+            // Save the difference image, scale brightness up 4x
+            dr=(dr*60/max)>> 6; if (dr > 255) dr = 255;
+            dg=(dg*60/max)>> 6; if (dg > 255) dg = 255;
+            db=(db*60/max)>> 6; if (db > 255) db = 255;
+            pd[0] = dr;
+            pd[1] = dg;
+            pd[2] = db;
+        }
+
+        // Advance pointers to next pixel.
+        if (pd) pd += 3;
+        p1 += 3;
+        p2 += 3;
+    }
+}
+
+//----------------------------------------------------------------------------------------
+// Difference kernel for luma only (one component) pictures.  Gives the same result
+// DiffRowScalar would give for gray pixels with red, green and blue all the same.
+//----------------------------------------------------------------------------------------
+void DiffRowGray(const unsigned char * p1, const unsigned char * p2,
+        int n, int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd)
+{
+    for (int col=0;col<n;col++){
+        int d, dcomp, max;
+        {
+            int max1, max2;
+            max1 = p1[col]*m1i;
+            if (p2[col] > max1) max1 = p2[col];
+            max2 = p2[col]*m2i;
+            max = max2 > max1 ? max2 : max1;
+            max = max >> 8;
+            if (max < 40) max = 40; // Don't allow under 40 to avoid amlifying dark noise.
+        }
+
+        d = p1[col]*m1i - p2[col]*m2i;
+        if (d < 0) d = -d;
+
+        dcomp = (d*4) >> 8;         // Same weight as red + 2x green + blue
+        dcomp = dcomp * 120/max;    // Normalize difference to local brightness.
+        if (dcomp >= 256) dcomp = 255;
+
+        DiffHist[dcomp] += 1;
+        diffrow[col] = dcomp;
+
+        if (pd){
+            // Save the difference image, scale brightness up 4x
+            d = (d*60/max) >> 6; if (d > 255) d = 255;
+            pd[col] = d;
+        }
+    }
+}
+
+// Room DiffSpanYcc needs for its chroma differences of one row.
+#define YCC_ROW_INTS(width) (5*((width)+2))
+
+//----------------------------------------------------------------------------------------
+// How much brighter than luma the brightest of red, green or blue is for this chroma.
+//----------------------------------------------------------------------------------------
+static inline int MaxColorOverLuma(int cb, int cr)
+{
+    int r, g, b, max;
+    cb -= 128;
+    cr -= 128;
+    r = cr*359;             // 1.402 * 256
+    g = -(cb*88 + cr*183);  // 0.344, 0.714
+    b = cb*454;             // 1.772
+    max = r > g ? r : g;
+    if (b > max) max = b;
+    return max >> 8;
+}
+
+//----------------------------------------------------------------------------------------
+// Differences for pixels x1 to x2 of a row of Ycc pictures.  Luma is compared at full
+// resolution, chroma at the half resolution it was stored in the jpeg at.  Red, green
+// and blue differences are worked out from the luma and chroma differences, so the
+// composite difference comes out close to what the RGB kernels compute, but not the
+// same: chroma differences are averaged over 2x2 pixels, the worked out red, green and
+// blue aren't clamped to 0-255, and the brightest of them goes by luma plus the chroma
+// part.  Rows is room for YCC_ROW_INTS(width) ints.
+//----------------------------------------------------------------------------------------
+static void DiffSpanYcc(MemImage_t * pic1, MemImage_t * pic2, int row, int x1, int x2,
+        int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd, int * Rows)
+{
+    int width = pic1->width;
+    int n = x2-x1;
+    int crow = (row/2)*CHROMA_W(pic1);
+    const unsigned char * y1 = pic1->pixels+row*width+x1;
+    const unsigned char * y2 = pic2->pixels+row*width+x1;
+    const unsigned char * cb1 = CB_PLANE(pic1)+crow, * cb2 = CB_PLANE(pic2)+crow;
+    const unsigned char * cr1 = CR_PLANE(pic1)+crow, * cr2 = CR_PLANE(pic2)+crow;
+    int odd = x1 & 1;
+
+    // Chroma part of the red, green and blue differences, and of the brightest of red,
+    // green and blue, worked out once for each pair of pixels.
+    int * dcr = Rows, * dcg = dcr+n+2, * dcb = dcg+n+2, * maxc1 = dcb+n+2, * maxc2 = maxc1+n+2;
+    for (int c=x1/2, k=0;c<=(x2-1)/2;c++, k+=2){
+        int dCb = (cb1[c]-128)*m1i - (cb2[c]-128)*m2i;
+        int dCr = (cr1[c]-128)*m1i - (cr2[c]-128)*m2i;
+        dcr[k] = dcr[k+1] = (dCr*359) >> 8;             // 1.402
+        dcg[k] = dcg[k+1] = -(dCb*88 + dCr*183) >> 8;   // 0.344, 0.714
+        dcb[k] = dcb[k+1] = (dCb*454) >> 8;             // 1.772
+        maxc1[k] = maxc1[k+1] = MaxColorOverLuma(cb1[c], cr1[c])*m1i;
+        maxc2[k] = maxc2[k+1] = MaxColorOverLuma(cb2[c], cr2[c])*m2i;
+    }
+
+    // Written so the compiler can vectorize it.  Single precision division gives
+    // the same quotient as integer division for these ranges.
+    for (int i=0;i<n;i++){
+        int k = i+odd;
+        int a = y1[i]*m1i, b = y2[i]*m2i;
+        int max1 = a+maxc1[k], max2 = b+maxc2[k];
+        int max = (max2 > max1 ? max2 : max1) >> 8;
+        if (max < 40) max = 40; // Don't allow under 40 to avoid amlifying dark noise.
+
+        int dy = a-b;
+        int dr = abs(dy+dcr[k]), dg = abs(dy+dcg[k]), db = abs(dy+dcb[k]);
+        int dcomp = (dr + dg*2 + db) >> 8; // Put more emphasis on green
+        dcomp = (int)((float)(dcomp*120)/(float)max); // Normalize difference to local brightness.
+        diffrow[i] = dcomp > 255 ? 255 : dcomp;
+    }
+    for (int i=0;i<n;i++) DiffHist[diffrow[i]] += 1;
+
+    if (pd){
+        // Save the difference image, scale brightness up 4x
+        for (int i=0;i<n;i++){
+            int k = i+odd;
+            int a = y1[i]*m1i, b = y2[i]*m2i;
+            int max1 = a+maxc1[k], max2 = b+maxc2[k];
+            int max = (max2 > max1 ? max2 : max1) >> 8;
+            if (max < 40) max = 40;
+            int dy = a-b;
+            int d = (abs(dy+dcr[k]) + abs(dy+dcg[k])*2 + abs(dy+dcb[k])) >> 2;
+            d = (d*60/max) >> 6;
+            pd[i] = d > 255 ? 255 : d;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------
+// Pick the difference kernel for pictures with this many components.
+// The SIMD kernels don't produce the debug image, so use the scalar one for that.
+//----------------------------------------------------------------------------------------
+static DiffRowFunc_t PickDiffRow(int components, int ForDebugImage)
+{
+    if (components == 1) return DiffRowGray;
+    return ForDebugImage ? DiffRowScalar : DiffRowKernel;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Work shared between the threads for one comparison.  Each band of rows gets
+// its own brightness sums and histogram, which get merged once all bands are done.
+//----------------------------------------------------------------------------------------
+typedef struct CompareJob_s {
+    CompareContext_t * Ctx;
+    MemImage_t * pic1, * pic2;
+    MemImage_t * DiffOut;
+    Region_t MainReg;
+    int m1i, m2i;
+    int HaveBright1, HaveBright2;
+    double BrightSum1[MAX_THREADS], BrightSum2[MAX_THREADS];
+    int BrightPixels[MAX_THREADS];
+    int DiffHist[MAX_THREADS][256];
+}CompareJob_t;
+
+//----------------------------------------------------------------------------------------
+// Brightness sums for one band.
+//----------------------------------------------------------------------------------------
+static void BrightBand(void * Arg, int Band, int NumBands)
+{
+    CompareJob_t * Job = Arg;
+    WeightMap_t * WeightMap = Job->Ctx->WeightMap;
+    Region_t Reg = BandRegion(Job->MainReg, Band, NumBands);
+    // Pictures whose brightness is already known are skipped.
+    if (!Job->HaveBright1){
+        Job->BrightSum1[Band] = SumBright(Job->pic1, Reg, WeightMap, &Job->BrightPixels[Band]);
+    }
+    if (!Job->HaveBright2){
+        Job->BrightSum2[Band] = SumBright(Job->pic2, Reg, WeightMap, &Job->BrightPixels[Band]);
+    }
+}
+
+//----------------------------------------------------------------------------------------
+// Differences for one band.
+//----------------------------------------------------------------------------------------
+static void DiffBand(void * Arg, int Band, int NumBands)
+{
+    CompareJob_t * Job = Arg;
+    WeightMap_t * WeightMap = Job->Ctx->WeightMap;
+    DiffMap_t * DiffVal = Job->Ctx->DiffVal;
+    Region_t Reg = BandRegion(Job->MainReg, Band, NumBands);
+    int width = Job->pic1->width;
+    int nc = Job->pic1->components;
+    int * DiffHist = Job->DiffHist[Band];
+    DiffRowFunc_t DiffRow = PickDiffRow(nc, Job->DiffOut != NULL);
+
+    memset(DiffHist, 0, sizeof(Job->DiffHist[0]));
+    for (int row=Reg.y1;row<Reg.y2;row++){
+        for (Span_t * sp = FIRST_SPAN(WeightMap, row); sp < END_SPAN(WeightMap, row); sp++){
+            int offset = row*width + sp->x1;
+            unsigned char * pd = NULL;
+            if (Job->DiffOut) pd = Job->DiffOut->pixels+offset*nc;
+            if (Job->pic1->Ycc){
+                DiffSpanYcc(Job->pic1, Job->pic2, row, sp->x1, sp->x2, Job->m1i, Job->m2i,
+                    &DiffVal->values[offset], DiffHist, pd, Job->Ctx->YccRows+Band*YCC_ROW_INTS(width));
+                continue;
+            }
+            DiffRow(Job->pic1->pixels+offset*nc, Job->pic2->pixels+offset*nc,
+                sp->x2-sp->x1, Job->m1i, Job->m2i, &DiffVal->values[offset], DiffHist, pd);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------
+// Make sure we have working maps for pictures of this size.  If the size changed,
+// start over with maps for the new size.  Returns 0 if the weight map doesn't fit.
+//----------------------------------------------------------------------------------------
+static int AllocWorkingMaps(CompareContext_t * Ctx, int width, int height)
+{
+    if (Ctx->DiffVal != NULL && (width != Ctx->DiffVal->w || height != Ctx->DiffVal->h)){
+        // Picture size changed.  Motion fatigue is for the old size too, so that goes as well.
+        printf("Picture size changed to %dx%d\n", width, height);
+        FreeSizedMaps(Ctx);
+    }
+    if (Ctx->DiffVal == NULL){
+        if (!Ctx->WeightMap){
+            Ctx->WeightMap = FillWeightMap(width, height, &Ctx->Regions);
+        }else{
+            if (Ctx->WeightMap->w != width || Ctx->WeightMap->h != height){
+                fprintf(stderr,"diff map image size mismatch\n");
+                return 0;
+            }
+        }
+
+        Ctx->DiffVal = malloc(offsetof(DiffMap_t, values)+width*height);
+        Ctx->DiffVal->w = width;
+        Ctx->DiffVal->h = height;
+        Ctx->YccRows = malloc(sizeof(int)*YCC_ROW_INTS(width)*MAX_THREADS);
+    }
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+// Clip detection region to the image.  Returns number of pixels in it, or 0 if its no good.
+//----------------------------------------------------------------------------------------
+static int GetMainRegion(CompareContext_t * Ctx, int width, int height, Region_t * pMainReg)
+{
+    Region_t MainReg;
+    int DetectionPixels;
+
+    MainReg = Ctx->Regions.DetectReg;
+    if (MainReg.y2 > height) MainReg.y2 = height;
+    if (MainReg.x2 > width) MainReg.x2 = width;
+    if (MainReg.x2 < MainReg.x1 || MainReg.y2 < MainReg.y1){
+        fprintf(stderr, "Negative region, or region outside of image\n");
+        return 0;
+    }
+
+    DetectionPixels = (MainReg.x2-MainReg.x1) * (MainReg.y2-MainReg.y1);
+    if (DetectionPixels < 1000){
+        fprintf(stderr, "Too few pixels in region\n");
+        return 0;
+    }
+    *pMainReg = MainReg;
+    return DetectionPixels;
+}
+
+//----------------------------------------------------------------------------------------
+// Compute brightness multipliers for the two images
+//----------------------------------------------------------------------------------------
+static void CalcMultipliers(double b1average, double b2average, double * pm1, double * pm2, double * pBrightnessRatio)
+{
+    double m1, m2;
+
+    if (b1average < 0.5) b1average = 0.5; // Avoid possible division by zero.
+    if (b2average < 0.5) b2average = 0.5;
 
+    m1 = 80/b1average;
+    m2 = 80/b2average;
+
+    {
+        double maxm, minm;
+        if (m1 > m2){
+            maxm = m1; minm = m2;
+        }else{
+            maxm = m2; minm = m1;
+        }
+        *pBrightnessRatio = maxm/minm;
+
+        if (maxm > 2.5){
+            // Don't allow multiplier to get bigger than 2.5.  Otherwise, for dark images
+            // we just end up multiplying pixel noise!
+            m1 = m1 * 2.5 / maxm;
+            m2 = m2 * 2.5 / maxm;
+        }else if (maxm < 1.0){
+            // And there's no point in scaling down both images either.
+            m1 = m1 * 1 / maxm;
+            m2 = m2 * 1 / maxm;
+        }
+    }
+    *pm1 = m1;
+    *pm2 = m2;
+}
+
+//----------------------------------------------------------------------------------------
+// Bounding box of the pixels that get compared: the detection region, narrowed down to
+// where the weight map has any weight.  Only known once the working maps are made for
+// the picture size.  Returns 0 if it's not known, or not worth cropping to.
+//----------------------------------------------------------------------------------------
+static int GetDecodeBox(CompareContext_t * Ctx, int scale_denom, Region_t * pBox)
+{
+    if (Ctx->DiffVal == NULL || Ctx->WeightMap == NULL || scale_denom != Ctx->ScaleDenom) return 0;
+    int width = Ctx->DiffVal->w, height = Ctx->DiffVal->h;
+
+    Region_t MainReg = Ctx->Regions.DetectReg;
+    if (MainReg.y2 > height) MainReg.y2 = height;
+    if (MainReg.x2 > width) MainReg.x2 = width;
+
+    Region_t Box = {width, 0, height, 0};
+    for (int row=MainReg.y1;row<MainReg.y2;row++){
+        for (Span_t * sp = FIRST_SPAN(Ctx->WeightMap, row); sp < END_SPAN(Ctx->WeightMap, row); sp++){
+            int x1 = sp->x1 > MainReg.x1 ? sp->x1 : MainReg.x1;
+            int x2 = sp->x2 < MainReg.x2 ? sp->x2 : MainReg.x2;
+            if (x2 <= x1) continue;
+            if (x1 < Box.x1) Box.x1 = x1;
+            if (x2 > Box.x2) Box.x2 = x2;
+            if (row < Box.y1) Box.y1 = row;
+            Box.y2 = row+1;
+        }
+    }
+    if (Box.x2 <= Box.x1) return 0;
+    if ((Box.x2-Box.x1)*(Box.y2-Box.y1) > width*height*9/10) return 0; // Whole picture anyway.
+    *pBox = Box;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+// Check that a picture came out the size its decode box was worked out for.
+//----------------------------------------------------------------------------------------
+static int FitsBox(MemImage_t * pic, int width, int height)
+{
+    if (pic == NULL) return 1; // Nothing to redo.
+    return pic->width == width && pic->height == height;
+}
+
+//----------------------------------------------------------------------------------------
+// Fused decode and compare.  Differences are computed as rows come out of the jpeg
+// decoder, while they are still in cache, using brightness multipliers predicted from
+// the previous picture (the current picture's brightness isn't known until its decoded)
+// ComparePix then only needs to redo the differences if the prediction was too far off.
+//----------------------------------------------------------------------------------------
+typedef struct FusedCompare_s {
+    MemImage_t * pic1, * pic2;
+    FrameFeatures_t * feat1;
+    Region_t MainReg;
+    int m1i, m2i;           // Predicted multipliers differences were computed with.
+    int RowsDone;
+    double BrightSum2;
+    int BrightPixels;
+    int DiffHist[256];
+}FusedCompare_t;
+
+// Prediction may be this many percent off before differences get recomputed.
+#define FUSED_MULT_TOLERANCE 1
+
+//----------------------------------------------------------------------------------------
+// Called by the jpeg decoder with each batch of rows it decodes.
+//----------------------------------------------------------------------------------------
+static void FusedRows(MemImage_t * pic2, int FirstRow, int NumRows, void * Arg)
+{
+    CompareContext_t * Ctx = Arg;
+    FusedCompare_t * Fused = Ctx->Fused;
+    MemImage_t * pic1 = Fused->pic1;
+    int width = pic2->width;
+    int nc = pic2->components;
+
+    if (pic1 == NULL) return; // Fusing not possible for this picture.
+
+    if (Fused->pic2 == NULL){
+        // First rows of picture.  Set up.
+        double b1average, m1, m2, BrightnessRatio;
+        if (pic1->width != width || pic1->height != pic2->height
+            || pic1->components != nc || pic1->Ycc != pic2->Ycc){
+            // Let ComparePix deal with it.
+            Fused->pic1 = NULL;
+            return;
+        }
+        if (!AllocWorkingMaps(Ctx, width, pic2->height)
+                || !GetMainRegion(Ctx, width, pic2->height, &Fused->MainReg)){
+            Fused->pic1 = NULL;
+            return;
+        }
+
+        if (Fused->feat1 && Fused->feat1->HaveBright){
+            b1average = Fused->feat1->Bright;
+        }else{
+            b1average = AverageBright(pic1, Fused->MainReg, Ctx->WeightMap);
+        }
+        // Predict the new picture is as bright as the last one.
+        CalcMultipliers(b1average, b1average, &m1, &m2, &BrightnessRatio);
+        Fused->m1i = (int)(m1*256+0.5);
+        Fused->m2i = (int)(m2*256+0.5);
+        Fused->pic2 = pic2;
+        Fused->BrightSum2 = 0;
+        Fused->BrightPixels = 0;
+        memset(Fused->DiffHist, 0, sizeof(Fused->DiffHist));
+    }
+
+    WeightMap_t * WeightMap = Ctx->WeightMap;
+    Region_t Band = Fused->MainReg;
+    if (FirstRow > Band.y1) Band.y1 = FirstRow;
+    if (FirstRow+NumRows < Band.y2) Band.y2 = FirstRow+NumRows;
+    if (Band.y2 > Band.y1){
+        int Pixels;
+        DiffRowFunc_t DiffRow = PickDiffRow(nc, 0);
+        Fused->BrightSum2 += SumBright(pic2, Band, WeightMap, &Pixels);
+        Fused->BrightPixels += Pixels;
+
+        for (int row=Band.y1;row<Band.y2;row++){
+            for (Span_t * sp = FIRST_SPAN(WeightMap, row); sp < END_SPAN(WeightMap, row); sp++){
+                int offset = row*width + sp->x1;
+                if (pic2->Ycc){
+                    DiffSpanYcc(pic1, pic2, row, sp->x1, sp->x2, Fused->m1i, Fused->m2i,
+                        &Ctx->DiffVal->values[offset], Fused->DiffHist, NULL, Ctx->YccRows);
+                    continue;
+                }
+                DiffRow(pic1->pixels+offset*nc, pic2->pixels+offset*nc,
+                    sp->x2-sp->x1, Fused->m1i, Fused->m2i, &Ctx->DiffVal->values[offset], Fused->DiffHist, NULL);
+            }
+        }
+    }
+    Fused->RowsDone = FirstRow+NumRows;
+}
+
+//----------------------------------------------------------------------------------------
+// Load a jpeg, computing differences to the previous picture as its decoded.
+// The following ComparePix with the same two pictures picks up the results.
+//----------------------------------------------------------------------------------------
+MemImage_t * LoadJPEGCompare(CompareContext_t * Ctx, FileData_t * File, int scale_denom, int ParseExif,
+        MemImage_t * PrevPic, FrameFeatures_t * PrevFeat)
+{
+    Region_t Box;
+    int HaveBox = GetDecodeBox(Ctx, scale_denom, &Box);
+    int width = HaveBox ? Ctx->DiffVal->w : 0, height = HaveBox ? Ctx->DiffVal->h : 0;
+    memset(Ctx->Fused, 0, sizeof(FusedCompare_t));
+    Ctx->Fused->pic1 = PrevPic;
+    Ctx->Fused->feat1 = PrevFeat;
+    MemImage_t * pic = LoadJPEGRows(File, scale_denom, DecodeColors, ParseExif,
+            PrevPic ? FusedRows : NULL, Ctx, HaveBox ? &Box : NULL);
+    if (HaveBox && !FitsBox(pic, width, height)){
+        // Picture size changed, so the box was for the wrong size.  Do it again whole.
+        FreeMemImage(pic);
+        Ctx->Fused->pic1 = Ctx->Fused->pic2 = NULL;
+        pic = LoadJPEGRows(File, scale_denom, DecodeColors, 0, NULL, NULL, NULL);
+    }
+    return pic;
+}
+
+//----------------------------------------------------------------------------------------
+// Work out what part of the next picture needs decoding, for LoadJPEGBox.
+//----------------------------------------------------------------------------------------
+void PlanDecode(CompareContext_t * Ctx, int scale_denom, DecodeBox_t * Plan)
+{
+    Plan->ScaleDenom = scale_denom;
+    Plan->HaveBox = GetDecodeBox(Ctx, scale_denom, &Plan->Box);
+    if (Plan->HaveBox){
+        Plan->Width = Ctx->DiffVal->w;
+        Plan->Height = Ctx->DiffVal->h;
+    }
+}
+
+//----------------------------------------------------------------------------------------
+// Load a jpeg for comparing, decoding only the part of it from PlanDecode.
+// Doesn't use the compare context, so it can run on a decode thread.
+//----------------------------------------------------------------------------------------
+MemImage_t * LoadJPEGBox(FileData_t * File, const DecodeBox_t * Plan, int ParseExif)
+{
+    if (!Plan->HaveBox){
+        return LoadJPEGRows(File, Plan->ScaleDenom, DecodeColors, ParseExif, NULL, NULL, NULL);
+    }
+
+    MemImage_t * pic = LoadJPEGRows(File, Plan->ScaleDenom, DecodeColors, ParseExif, NULL, NULL, &Plan->Box);
+    if (!FitsBox(pic, Plan->Width, Plan->Height)){
+        FreeMemImage(pic);
+        pic = LoadJPEGRows(File, Plan->ScaleDenom, DecodeColors, 0, NULL, NULL, NULL);
+    }
+    return pic;
+}
+
+//----------------------------------------------------------------------------------------
+// Load a jpeg for comparing.  Only the part of it that detection looks at gets decoded.
+//----------------------------------------------------------------------------------------
+MemImage_t * LoadJPEGDetect(CompareContext_t * Ctx, FileData_t * File, int scale_denom, int ParseExif)
+{
+    DecodeBox_t Plan;
+    PlanDecode(Ctx, scale_denom, &Plan);
+    return LoadJPEGBox(File, &Plan, ParseExif);
+}
+
+//----------------------------------------------------------------------------------------
+// Make a compare context using the current configuration.
+//----------------------------------------------------------------------------------------
+CompareContext_t * NewCompareContext(void)
+{
+    CompareContext_t * Ctx = calloc(1, sizeof(CompareContext_t));
+    Ctx->Job = calloc(1, sizeof(CompareJob_t));
+    Ctx->Job->Ctx = Ctx;
+    Ctx->Fused = calloc(1, sizeof(FusedCompare_t));
+
+    Ctx->Regions = Ctx->BaseRegions = Regions;
+    Ctx->ScaleDenom = Ctx->BaseScaleDenom = ScaleDenom;
+
+    // Own copy of the excludes, so they can be rescaled without touching the configuration.
+    Ctx->Regions.ExcludeReg = malloc(sizeof(Region_t)*(Regions.NumExcludeReg+1));
+    if (Regions.NumExcludeReg){
+        memcpy(Ctx->Regions.ExcludeReg, Regions.ExcludeReg, sizeof(Region_t)*Regions.NumExcludeReg);
+    }
+    Ctx->Sensitivity = Sensitivity;
+    Ctx->MotionFatigueTc = MotionFatigueTc;
+    Ctx->FatigueGainPercent = FatigueGainPercent;
+    Ctx->PyramidPercent = PyramidPercent;
+    Ctx->DctPercent = DctPercent;
+
+    if ((PyramidPercent || DctPercent) && MotionFatigueTc){
+        // Motion fatigue builds up from the full resolution differences of every picture,
+        // which the coarse compare doesn't have.
+        fprintf(stderr, "pyramid and dctfilter need motion fatigue off (fatigue_tc 0)\n");
+        exit(-1);
+    }
+    return Ctx;
+}
+
+//----------------------------------------------------------------------------------------
+// Free a compare context and all its working maps.
+//----------------------------------------------------------------------------------------
+void FreeCompareContext(CompareContext_t * Ctx)
+{
+    FreeSizedMaps(Ctx);
+    FreeWeightMap(Ctx->WeightMap);
+    free(Ctx->Regions.ExcludeReg);
+    free(Ctx->Job);
+    free(Ctx->Fused);
+    free(Ctx);
+}
+
+//----------------------------------------------------------------------------------------
+// Convert a region from one decode scale to another.
+//----------------------------------------------------------------------------------------
+static Region_t RescaleRegion(Region_t Reg, int FromDenom, int ToDenom)
+{
+    Reg.x1 = Reg.x1*FromDenom/ToDenom;
+    Reg.x2 = Reg.x2*FromDenom/ToDenom;
+    Reg.y1 = Reg.y1*FromDenom/ToDenom;
+    Reg.y2 = Reg.y2*FromDenom/ToDenom;
+    return Reg;
+}
+
+//----------------------------------------------------------------------------------------
+// Change the scale pictures get decoded at.  Regions are rescaled to match, and the
+// working maps get made over for the new picture size on the next compare.
+// Returns 0 if the weights came from a diff map, which only fits the original size.
+//----------------------------------------------------------------------------------------
+int SetCompareScale(CompareContext_t * Ctx, int ScaleDenom)
+{
+    int a;
+    if (ScaleDenom == Ctx->ScaleDenom) return 1;
+    if (Ctx->WeightMapFromFile) return 0;
+
+    Ctx->ScaleDenom = ScaleDenom;
+    Ctx->Regions.DetectReg = RescaleRegion(Ctx->BaseRegions.DetectReg, Ctx->BaseScaleDenom, ScaleDenom);
+    for (a=0;a<Ctx->Regions.NumExcludeReg;a++){
+        Ctx->Regions.ExcludeReg[a] = RescaleRegion(Ctx->BaseRegions.ExcludeReg[a],
+                Ctx->BaseScaleDenom, ScaleDenom);
+    }
+    FreeSizedMaps(Ctx);
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+// Gauge the difference noise level of the difference maps using the built histogram.
+// assuming two thirds of the image has not changed
+//----------------------------------------------------------------------------------------
+static int CalcThreshold(const int * DiffHist, int DetectionPixels, double BrightnessRatio)
+{
+    int a, threshold;
+    int cumsum = 0;
+    int twothirds = DetectionPixels*2/3;
+
+    for (a=0;a<256;a++){
+        if (cumsum >= twothirds) break;
+        cumsum += DiffHist[a];
+    }
+
+    threshold = a*3+12;
+    if (threshold < 30) threshold = 30;
+
+    int maxth = 180 + BrightnessRatio*5;
+    if (threshold > maxth){
+        threshold = maxth;
+        if (Verbosity) printf("Using limit threshold of %d\n", threshold);
+    }else{
+        if (Verbosity) printf("2/3 of image is below %d diff.  Using %d threshold\n",a, threshold);
+    }
+    return threshold;
+}
 
 //----------------------------------------------------------------------------------------
 // Compare two images in memory
-// Pic1 is previous pic, pic2 is latest pic.
+// Pic1 is previous pic, pic2 is latest pic.  feat1 and feat2, if not NULL, hold what's
+// already known about the pictures from earlier comparisons, and get filled in.
 //----------------------------------------------------------------------------------------
-TriggerInfo_t ComparePix(MemImage_t * pic1, MemImage_t * pic2,
-    int UpdateFatigue, int SkipFatigue, char * DebugImgName, TriggerInfo_t * no_fatigue_motion)
+TriggerInfo_t ComparePix(CompareContext_t * Ctx, MemImage_t * pic1, MemImage_t * pic2, FrameFeatures_t * feat1, FrameFeatures_t * feat2,
+    int UpdateFatigue, int SkipFatigue, char * DebugImgName, TriggerList_t * no_fatigue_motion)
 {
     int width, height, bPerRow;
-    int row, col;
     MemImage_t * DiffOut = NULL;
     int DiffHist[256];
     int a;
@@ -38,6 +707,10 @@ TriggerInfo_t ComparePix(MemImage_t * pic1, MemImage_t * pic2,
     int m1i, m2i;
     double BrightnessRatio;
     Region_t MainReg;
+    CompareJob_t * Job = Ctx->Job;
+    FusedCompare_t * Fuse = NULL;
+    FrameFeatures_t Unknown1 = {0}, Unknown2 = {0};
+    int KeepsFeatures = feat1 && feat2; // Caller holds on to what gets worked out about the pictures.
     TriggerInfo_t RetVal;
     RetVal.x = RetVal.y = 0;
     RetVal.DiffLevel = -1;
@@ -48,103 +721,85 @@ TriggerInfo_t ComparePix(MemImage_t * pic1, MemImage_t * pic2,
     }
 
     if (pic1->width != pic2->width || pic1->height != pic2->height
-        || pic1->components != pic2->components){
+        || pic1->components != pic2->components || pic1->Ycc != pic2->Ycc){
         fprintf(stderr, "pic size mismatch (maybe clear ramdisk?)\n  %dx%d vs %dx%d\n",pic1->width, pic1->height, pic2->width, pic2->height);
-        exit(-1);
-        //return RetVal;
+        return RetVal;
     }
     width = pic1->width;
     height = pic1->height;
-    bPerRow = width * 3;
+    bPerRow = width * pic1->components;
 
-    // Make sure we have an allocated working array and weight map.
-
-    if (DiffVal != NULL && (width != DiffVal->w || height != DiffVal->h)){
-        // DiffVal allocated size is wrong.
-        free(DiffVal);
-        free(WeightMap);
-        DiffVal = NULL;
+    if (Ctx->Fused->pic1 == pic1 && Ctx->Fused->pic2 == pic2 && Ctx->Fused->RowsDone >= height && !DebugImgName){
+        // Differences were already computed while decoding.
+        Fuse = Ctx->Fused;
     }
-    if (DiffVal == NULL){
-        DiffVal = MakeImgMap(width,height);
+    Ctx->Fused->pic1 = Ctx->Fused->pic2 = NULL; // DiffVal is about to get used for this comparison.
 
-        if (!WeightMap){
-            FillWeightMap(width,height);
-        }else{
-            if (WeightMap->w != width || WeightMap->h != height){
-                fprintf(stderr,"diff map image size mismatch\n");
-                exit(-1);
-            }
-        }
-    }
-    memset(DiffVal->values, 0,  sizeof(DiffVal->values)*width*height);
+    if (!AllocWorkingMaps(Ctx, width, height)) return RetVal;
 
     if (DebugImgName){
-        // Create image for writing difference to.
-        int data_size;
-        data_size = height * bPerRow;
-        DiffOut = malloc(data_size+offsetof(MemImage_t, pixels));
-        memcpy(DiffOut, pic1, offsetof(MemImage_t, pixels));
-        memset(DiffOut->pixels, 0, data_size);
+        // Create image for writing difference to.  Just the one plane for Ycc.
+        DiffOut = NewMemImage(width, height, pic1->components, 0);
+        memset(DiffOut->pixels, 0, height * bPerRow);
     }
 
-    MainReg = Regions.DetectReg;
-    if (MainReg.y2 > height) MainReg.y2 = height;
-    if (MainReg.x2 > width) MainReg.x2 = width;
-    if (MainReg.x2 < MainReg.x1 || MainReg.y2 < MainReg.y1){
-        fprintf(stderr, "Negative region, or region outside of image\n");
-        return RetVal;
-    }
-
-    DetectionPixels = (MainReg.x2-MainReg.x1) * (MainReg.y2-MainReg.y1);
-    if (DetectionPixels < 1000){
-        fprintf(stderr, "Too few pixels in region\n");
-        return RetVal;
-    }
+    DetectionPixels = GetMainRegion(Ctx, width, height, &MainReg);
+    if (DetectionPixels == 0) return RetVal;
 
     if (Verbosity > 0){
         printf("Detection region is %d-%d, %d-%d\n",MainReg.x1, MainReg.x2, MainReg.y1, MainReg.y2);
     }
 
+    int Pyramid = Ctx->PyramidPercent && KeepsFeatures && !Fuse && !Ctx->RecheckAround && !DebugImgName;
+    if (Pyramid){
+        // Brightness gets summed up while making the coarse copies, so a picture that the
+        // coarse compare settles only gets read once.
+        if (feat1->Coarse == NULL) feat1->Coarse = MakeCoarse(Ctx, pic1, MainReg, feat1);
+        if (feat2->Coarse == NULL) feat2->Coarse = MakeCoarse(Ctx, pic2, MainReg, feat2);
+    }
 
     // Compute brightness multipliers for the two images
     {
         double b1average, b2average;
         double m1, m2;
-        b1average = AverageBright(pic1, MainReg, WeightMap);
-        b2average = AverageBright(pic2, MainReg, WeightMap);
+        double Sum1 = 0, Sum2 = 0;
+        int Pixels = 0;
+
+        Job->pic1 = pic1;
+        Job->pic2 = pic2;
+        Job->MainReg = MainReg;
+        if (feat1 == NULL) feat1 = &Unknown1;
+        if (feat2 == NULL) feat2 = &Unknown2;
+
+        if (Fuse && !feat2->HaveBright){
+            // Brightness of the new picture was summed up while decoding.
+            feat2->Bright = BrightFromSum(Fuse->BrightSum2, Fuse->BrightPixels);
+            feat2->HaveBright = 1;
+        }
+
+        Job->HaveBright1 = feat1->HaveBright;
+        Job->HaveBright2 = feat2->HaveBright;
+        if (!Job->HaveBright1 || !Job->HaveBright2){
+            RunBands(BrightBand, Job);
+            for (a=0;a<NumBands;a++){
+                Sum1 += Job->BrightSum1[a];
+                Sum2 += Job->BrightSum2[a];
+                Pixels += Job->BrightPixels[a];
+            }
+            if (!feat1->HaveBright) feat1->Bright = BrightFromSum(Sum1, Pixels);
+            if (!feat2->HaveBright) feat2->Bright = BrightFromSum(Sum2, Pixels);
+            feat1->HaveBright = feat2->HaveBright = 1;
+        }
+        b1average = feat1->Bright;
+        b2average = feat2->Bright;
 
-        NewestAverageBright = (int)(b2average+0.5);
+        Ctx->NewestAverageBright = (int)(b2average+0.5);
 
         if (Verbosity > 0){
             printf("average bright: %f %f\n",b1average, b2average);
         }
-        if (b1average < 0.5) b1average = 0.5; // Avoid possible division by zero.
-        if (b2average < 0.5) b2average = 0.5;
 
-        m1 = 80/b1average;
-        m2 = 80/b2average;
-
-        {
-            double maxm, minm;
-            if (m1 > m2){
-                maxm = m1; minm = m2;
-            }else{
-                maxm = m2; minm = m1;
-            }
-            BrightnessRatio = maxm/minm;
-
-            if (maxm > 2.5){
-                // Don't allow multiplier to get bigger than 2.5.  Otherwise, for dark images
-                // we just end up multiplying pixel noise!
-                m1 = m1 * 2.5 / maxm;
-                m2 = m2 * 2.5 / maxm;
-            }else if (maxm < 1.0){
-                // And there's no point in scaling down both images either.
-                m1 = m1 * 1 / maxm;
-                m2 = m2 * 1 / maxm;
-            }
-        }
+        CalcMultipliers(b1average, b2average, &m1, &m2, &BrightnessRatio);
 
         if (Verbosity) printf("Brightness adjust multipliers:  m1 = %5.2f  m2=%5.2f\n",m1,m2);
 
@@ -152,87 +807,48 @@ TriggerInfo_t ComparePix(MemImage_t * pic1, MemImage_t * pic2,
         m2i = (int)(m2*256+0.5);
     }
 
-    // Compute differences
-    memset(DiffHist, 0, sizeof(DiffHist));
-    for (row=MainReg.y1;row<MainReg.y2;){
-        unsigned char * p1, *p2, *pd = NULL;
-        int * ExRow;
-        int * diffrow;
-        p1 = pic1->pixels+row*bPerRow + MainReg.x1*3;
-        p2 = pic2->pixels+row*bPerRow + MainReg.x1*3;
-        diffrow = &DiffVal->values[width*row];
-        ExRow = &WeightMap->values[width*row];
-        if (DebugImgName) pd = DiffOut->pixels+row*bPerRow;
-
-        for (col=MainReg.x1;col<MainReg.x2;col++){
-            if (ExRow[col]){
-                // Data is in order red, green, blue.
-                int dr,dg,db;
-                int dcomp;
-                int max;
-                {
-                    // Find maximum of red green or blue for either picture after adjustment.
-                    int max1, max2;
-                    max1 = p1[0];
-                    if (p1[1] > max1) max1 = p1[1];
-                    if (p1[2] > max1) max1 = p1[2];
-                    max1 *= m1i;
-                    max2 = p2[0];
-                    if (p2[1] > max1) max1 = p2[1];
-                    if (p2[2] > max1) max1 = p2[2];
-                    max2 *= m2i;
-                    max = max2 > max1 ? max2 : max1;
-                    max = max >> 8;
-                    if (max < 40) max = 40; // Don't allow under 40 to avoid amlifying dark noise.
-                }
-
-                // Compute red green and blue differences
-                dr = (p1[0]*m1i - p2[0]*m2i);
-                dg = (p1[1]*m1i - p2[1]*m2i);
-                db = (p1[2]*m1i - p2[2]*m2i);
-
-                // Make differences absolute values.
-                if (dr < 0) dr = -dr;
-                if (dg < 0) dg = -dg;
-                if (db < 0) db = -db;
-
-                // compute composite difference.
-                dcomp = (dr + dg*2 + db) >> 8; // Put more emphasis on green
-                dcomp = dcomp * 120/max;       // Normalize difference to local brightness.
+    if (Pyramid){
+        // Settle it with a coarse compare if there's clearly not enough change.
+        if (CoarseCompare(Ctx, feat1, feat2, MainReg, m1i, m2i, BrightnessRatio,
+                no_fatigue_motion, Ctx->PyramidPercent, &RetVal)){
+            return RetVal;
+        }
+    }
 
+    if (Ctx->RecheckAround && !DebugImgName){
+        // Try settling it from the differences around the motion.
+        AllocScaledMaps(Ctx);
+        if (RecheckLocal(Ctx, pic1, pic2, MainReg, DetectionPixels, m1i, m2i, BrightnessRatio,
+                *Ctx->RecheckAround, &RetVal)){
+            return RetVal;
+        }
+    }
 
-                // Add computed difference value to histogram bins.
-                if (dcomp >= 256) dcomp = 255;
-                if (dcomp < 0){
-                    fprintf(stderr,"Internal error dcomp\n");
-                    dcomp = 0;
-                }
-                DiffHist[dcomp] += 1;
-                diffrow[col] = dcomp;
-
-                if (DebugImgName){
-                    // Save the difference image, scale brightness up 4x
-                    dr=(dr*60/max)>> 6; if (dr > 255) dr = 255;
-                    dg=(dg*60/max)>> 6; if (dg > 255) dg = 255;
-                    db=(db*60/max)>> 6; if (db > 255) db = 255;
-                    pd[0] = dr;
-                    pd[1] = dg;
-                    pd[2] = db;
-                }
-            }
+    if (Fuse && (abs(Fuse->m1i-m1i)*100 > m1i*FUSED_MULT_TOLERANCE
+              || abs(Fuse->m2i-m2i)*100 > m2i*FUSED_MULT_TOLERANCE)){
+        // Brightness prediction was too far off.  Do the differences over.
+        if (Verbosity) printf("Fused compare multipliers off, recompute\n");
+        Fuse = NULL;
+    }
 
-            // Advance pointers to next pixel.
-            pd += 3;
-            p1 += 3;
-            p2 += 3;
+    if (Fuse){
+        memcpy(DiffHist, Fuse->DiffHist, sizeof(DiffHist));
+    }else{
+        // Compute differences
+        Job->m1i = m1i;
+        Job->m2i = m2i;
+        Job->DiffOut = DiffOut;
+        RunBands(DiffBand, Job);
+        memset(DiffHist, 0, sizeof(DiffHist));
+        for (int b=0;b<NumBands;b++){
+            for (a=0;a<256;a++) DiffHist[a] += Job->DiffHist[b][a];
         }
-        row++;
     }
 
 
     if (DebugImgName){
         WritePpmFile(DebugImgName,DiffOut);
-        free(DiffOut);
+        FreeMemImage(DiffOut);
     }
 
 
@@ -244,32 +860,44 @@ TriggerInfo_t ComparePix(MemImage_t * pic1, MemImage_t * pic2,
     }
 
     TriggerInfo_t Trigger;
-    int threshold;
-    {
-        // Gauge the difference noise level of the difference maps using the built histogram.
-        // assuming two thirds of the image has not changed
-        int cumsum = 0;
-        int twothirds = DetectionPixels*2/3;
-
-        for (a=0;a<256;a++){
-            if (cumsum >= twothirds) break;
-            cumsum += DiffHist[a];
-        }
-
-        threshold = a*3+12;
-        if (threshold < 30) threshold = 30;
-
-        int maxth = 180 + BrightnessRatio*5;
-        if (threshold > maxth){
-            threshold = maxth;
-            if (Verbosity) printf("Using limit threshold of %d\n", threshold);
-        }else{
-            if (Verbosity) printf("2/3 of image is below %d diff.  Using %d threshold\n",a, threshold);
-        }
+    int threshold = CalcThreshold(DiffHist, DetectionPixels, BrightnessRatio);
+
+    AllocScaledMaps(Ctx);
+    if (Ctx->RecheckAround){
+        // Leaves DiffScaled alone, the next recheck may need it.
+        ScaleDifferences(Ctx, Ctx->LocalScaled, MainReg, threshold, NULL);
+        Trigger = LocateMotion(Ctx, Ctx->LocalScaled, NULL);
+        Ctx->DiffFrom.pic1 = Ctx->DiffFrom.pic2 = NULL; // DiffVal is for these pictures now.
+    }else{
+        // Keep the differences of the compare before, and what these are from, for RecheckPix.
+        ImgMap_t * Prev = Ctx->PrevScaled;
+        Ctx->PrevScaled = Ctx->DiffScaled;
+        Ctx->DiffScaled = Prev;
+        Ctx->PrevFrom = Ctx->DiffFrom;
+        Ctx->DiffFrom.pic1 = pic1;
+        Ctx->DiffFrom.pic2 = pic2;
+        Ctx->DiffFrom.Threshold = threshold;
+        memcpy(Ctx->DiffFrom.Hist, DiffHist, sizeof(DiffHist));
+
+        // Apply motion fatigure and search for a window with the largest difference in it
+        Trigger = AnalyzeDifferences(Ctx, MainReg, threshold, UpdateFatigue, SkipFatigue, no_fatigue_motion);
     }
+    return Trigger;
+}
 
-    // Apply motion fatigure and search for a window with the largest difference in it
-    Trigger = AnalyzeDifferences(MainReg, threshold, UpdateFatigue, SkipFatigue, no_fatigue_motion);
+//----------------------------------------------------------------------------------------
+// Compare two images only to find out if there's still motion (DiffLevel >= Sensitivity)
+// where motion was found before.  Meant to give the same answer as ComparePix without
+// fatigue, but usually only computes differences for the area around Around (see
+// RecheckLocal).
+//----------------------------------------------------------------------------------------
+TriggerInfo_t RecheckPix(CompareContext_t * Ctx, MemImage_t * pic1, MemImage_t * pic2, FrameFeatures_t * feat1, FrameFeatures_t * feat2,
+        TriggerInfo_t Around)
+{
+    TriggerInfo_t Trigger;
+    Ctx->RecheckAround = &Around;
+    Trigger = ComparePix(Ctx, pic1, pic2, feat1, feat2, 0, 1, NULL, NULL);
+    Ctx->RecheckAround = NULL;
     return Trigger;
 }
 
@@ -282,22 +910,22 @@ static const int wind_w = 4, wind_h = 7;
 
 
 //----------------------------------------------------------------------------------------
-// Do the final bit of analysis after fatigue stuff to figure out where the motion was.
+// Work out where most of the motion was found inside a search window.
 //----------------------------------------------------------------------------------------
-static TriggerInfo_t LocateMotion(ImgMap_t * DiffScaled)
+static TriggerInfo_t WindowCentroid(CompareContext_t * Ctx, ImgMap_t * DiffScaled, int maxc, int maxr, int maxval)
 {
     TriggerInfo_t retval;
     int widthSc = DiffScaled->w;
+    int cellpix = scalef*Ctx->ScaleDenom;
 
-    int maxc, maxr, maxval;
-
-    maxval = BlockFilterImgMap(DiffScaled, wind_w, wind_h, &maxc, &maxr);
-
-    // Now search for the maximum inside a rectangular window.
     retval.DiffLevel = maxval/100;
     retval.x = retval.y = 0;
+    retval.Motion = 0;
+    retval.x1 = maxc*cellpix;
+    retval.y1 = maxr*cellpix;
+    retval.x2 = (maxc+wind_w)*cellpix;
+    retval.y2 = (maxr+wind_h)*cellpix;
 
-    // Work out where most of the motion was found inside the search window.
     if (Verbosity) printf("Window contents.  Cols %d-%d Rows %d-%d\n",maxc,maxc+wind_w-1,maxr, maxr+wind_h-1);
     if (maxval > 0){
         double xsum, ysum;
@@ -319,70 +947,159 @@ static TriggerInfo_t LocateMotion(ImgMap_t * DiffScaled)
             //printf("\n");
         }
         if (Verbosity) printf("Exact col=%5.1f, row=%5.1f\n",xsum*1.0/sum, ysum*1.0/sum);
-        retval.x = (int)(xsum*scalef*ScaleDenom/sum)+scalef*ScaleDenom/2;
-        retval.y = (int)(ysum*scalef*ScaleDenom/sum)+scalef*ScaleDenom/2;
+        retval.x = (int)(xsum*cellpix/sum)+cellpix/2;
+        retval.y = (int)(ysum*cellpix/sum)+cellpix/2;
         if (Verbosity) printf("Picture coordinates: x,y = %d,%d\n",retval.x, retval.y);
     }
-
     return retval;
 }
 
-
 //----------------------------------------------------------------------------------------
-// Compute and apply motion fatigue then  Search for an N x N window
-// with the maximum differences in it.
-// This for rejecting spurious differences outdoors where we dont want grass and leaves
-// moving in the wind (covering large parts of the image) to trigger motion events.
+// Do the final bit of analysis after fatigue stuff to figure out where the motion was.
+// If Objects is given, also look for other separate areas of motion.
 //----------------------------------------------------------------------------------------
-static TriggerInfo_t AnalyzeDifferences(Region_t Region, int threshold, int UpdateFatigue, int SkipFatigue,
-        TriggerInfo_t * no_fatigue_motion // In addition detect motion without fatigue and put it here.
-    )
+static TriggerInfo_t LocateMotion(CompareContext_t * Ctx, ImgMap_t * DiffScaled, TriggerList_t * Objects)
 {
-    static int widthSc, heightSc;
-    static ImgMap_t * DiffScaled = NULL;
-    static ImgMap_t * Fatigue = NULL;
-    static ImgMap_t * FatigueBl = NULL;
-
-    // Allocate working arrays if necessary.
-    if (DiffScaled == NULL){
-        #define ROOF_SC(x) ((x+scalef-1)/scalef)
-        widthSc = ROOF_SC(DiffVal->w);
-        heightSc = ROOF_SC(DiffVal->h);
-        DiffScaled = MakeImgMap(widthSc, heightSc);
-        Fatigue = MakeImgMap(widthSc, heightSc);
-        FatigueBl = MakeImgMap(widthSc, heightSc);
-    }else{
-        if (widthSc != ROOF_SC(DiffVal->w) || heightSc != ROOF_SC(DiffVal->h)){
-            fprintf(stderr, "image size changed, error!");
-            // Could reallocate, but probably other code doesn't handle resizing anyway.
-            exit(-1);
+    int maxc, maxr, maxval;
+    int Sensitivity = Ctx->Sensitivity;
+
+    // Search for the maximum inside a rectangular window.
+    maxval = BlockFilterImgMap(DiffScaled, Ctx->Filtered, wind_w, wind_h, &maxc, &maxr);
+    TriggerInfo_t retval = WindowCentroid(Ctx, DiffScaled, maxc, maxr, maxval);
+
+    if (Objects){
+        int cols[MAX_MOTION_OBJECTS], rows[MAX_MOTION_OBJECTS], vals[MAX_MOTION_OBJECTS];
+        int NumPeaks;
+
+        // Strongest window is the one found above.  Others only count if they
+        // are motion on their own.
+        Objects->Objects[0] = retval;
+        Objects->NumObjects = 1;
+        if (retval.DiffLevel < Sensitivity) return retval;
+
+        NumPeaks = BlockFilterPeaks(Ctx->Filtered, wind_w, wind_h, Sensitivity*100,
+                MAX_MOTION_OBJECTS, cols, rows, vals);
+        for (int a=1;a<NumPeaks;a++){
+            if (Verbosity) printf("Motion object %d:\n",a+1);
+            Objects->Objects[a] = WindowCentroid(Ctx, DiffScaled, cols[a], rows[a], vals[a]);
         }
+        if (NumPeaks > 1) Objects->NumObjects = NumPeaks;
     }
 
-    // Compute scaled down array of differences.  Destination: DiffScaled[]
+    return retval;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Sum up differences above threshold in Region into the cells of the scaled down
+// array.  Cells outside of region are zero.  If Hist is not NULL, also make a
+// histogram of the differences that were looked at.
+//----------------------------------------------------------------------------------------
+static void ScaleDifferences(CompareContext_t * Ctx, ImgMap_t * DiffScaled, Region_t Region, int threshold, int * Hist)
+{
+    DiffMap_t * DiffVal = Ctx->DiffVal;
+    WeightMap_t * WeightMap = Ctx->WeightMap;
     int width = DiffVal->w;
-    memset(DiffScaled->values, 0, sizeof(int)*widthSc*heightSc);
+    int widthSc = DiffScaled->w;
+    memset(DiffScaled->values, 0, sizeof(int)*widthSc*DiffScaled->h);
     for (int row=Region.y1;row<Region.y2;row++){
         // Compute difference by column using established threshold value
-        int * diffrow, *ExRow;
+        unsigned char * diffrow;
         int * widthScrow;
         diffrow = &DiffVal->values[width*row];
-        ExRow = &WeightMap->values[width*row];
 
         widthScrow = &DiffScaled->values[widthSc*(row/scalef)];
-        for (int col=Region.x1;col<Region.x2;col++){
-            int d = diffrow[col] - threshold;
-            if (d > 0){
-                widthScrow[col/scalef] += d;
-                if (ExRow[col] > 1){
-
-                    // Double weight region
-                    widthScrow[col/scalef] += d;
-                }
+        for (Span_t * sp = FIRST_SPAN(WeightMap, row); sp < END_SPAN(WeightMap, row); sp++){
+            int x1 = sp->x1 > Region.x1 ? sp->x1 : Region.x1;
+            int x2 = sp->x2 < Region.x2 ? sp->x2 : Region.x2;
+            int weight = sp->weight; // Double weight regions count twice.
+            for (int col=x1;col<x2;col++){
+                int d = diffrow[col] - threshold;
+                if (d > 0) widthScrow[col/scalef] += d*weight;
+            }
+            if (Hist){
+                for (int col=x1;col<x2;col++) Hist[diffrow[col]] += 1;
             }
         }
     }
+}
+
+#define ROOF_SC(x) ((x+scalef-1)/scalef)
+
+//----------------------------------------------------------------------------------------
+// Allocate scaled down working arrays if necessary.  These are the scaled down
+// differences, and motion fatigue at the same scale.
+//----------------------------------------------------------------------------------------
+static void AllocScaledMaps(CompareContext_t * Ctx)
+{
+    if (Ctx->DiffScaled == NULL){
+        int widthSc = Ctx->widthSc = ROOF_SC(Ctx->DiffVal->w);
+        int heightSc = Ctx->heightSc = ROOF_SC(Ctx->DiffVal->h);
+        Ctx->DiffScaled = MakeImgMap(widthSc, heightSc);
+        Ctx->PrevScaled = MakeImgMap(widthSc, heightSc);
+        Ctx->Fatigue = MakeImgMap(widthSc, heightSc);
+        Ctx->FatigueBl = MakeImgMap(widthSc, heightSc);
+        Ctx->Fatigued = MakeImgMap(widthSc, heightSc);
+        Ctx->LocalScaled = MakeImgMap(widthSc, heightSc);
+        Ctx->Filtered = MakeImgMap(widthSc, heightSc);
+    }
+}
 
+//----------------------------------------------------------------------------------------
+// Free everything that depends on the picture size.  A weight map made from the
+// regions goes too, a diff map loaded from a file is kept.
+//----------------------------------------------------------------------------------------
+static void FreeSizedMaps(CompareContext_t * Ctx)
+{
+    free(Ctx->DiffVal);
+    free(Ctx->YccRows);
+    free(Ctx->DiffScaled);
+    free(Ctx->PrevScaled);
+    free(Ctx->Fatigue);
+    free(Ctx->FatigueBl);
+    free(Ctx->Fatigued);
+    free(Ctx->LocalScaled);
+    free(Ctx->CellWeight);
+    free(Ctx->Filtered);
+    Ctx->DiffVal = NULL;
+    Ctx->YccRows = NULL;
+    Ctx->DiffScaled = Ctx->PrevScaled = Ctx->Fatigue = Ctx->FatigueBl = Ctx->Fatigued = NULL;
+    Ctx->DiffFrom.pic1 = Ctx->DiffFrom.pic2 = Ctx->PrevFrom.pic1 = Ctx->PrevFrom.pic2 = NULL;
+    Ctx->LocalScaled = Ctx->CellWeight = Ctx->Filtered = NULL;
+    if (!Ctx->WeightMapFromFile){
+        FreeWeightMap(Ctx->WeightMap);
+        Ctx->WeightMap = NULL;
+    }
+}
+
+//----------------------------------------------------------------------------------------
+// Compute and apply motion fatigue then  Search for an N x N window
+// with the maximum differences in it.
+// This for rejecting spurious differences outdoors where we dont want grass and leaves
+// moving in the wind (covering large parts of the image) to trigger motion events.
+//----------------------------------------------------------------------------------------
+static TriggerInfo_t AnalyzeDifferences(CompareContext_t * Ctx, Region_t Region, int threshold, int UpdateFatigue, int SkipFatigue,
+        TriggerList_t * no_fatigue_motion // In addition detect motion without fatigue and put it here.
+    )
+{
+    AllocScaledMaps(Ctx);
+
+    // Compute scaled down array of differences.  Destination: DiffScaled[]
+    ScaleDifferences(Ctx, Ctx->DiffScaled, Region, threshold, NULL);
+
+    return FatigueAndLocate(Ctx, UpdateFatigue, SkipFatigue, no_fatigue_motion);
+}
+
+//----------------------------------------------------------------------------------------
+// Apply motion fatigue to DiffScaled and find where the motion is.
+//----------------------------------------------------------------------------------------
+static TriggerInfo_t FatigueAndLocate(CompareContext_t * Ctx, int UpdateFatigue, int SkipFatigue, TriggerList_t * no_fatigue_motion)
+{
+    int widthSc = Ctx->widthSc, heightSc = Ctx->heightSc;
+    ImgMap_t * DiffScaled = Ctx->DiffScaled;
+    ImgMap_t * Fatigue = Ctx->Fatigue;
+    ImgMap_t * FatigueBl = Ctx->FatigueBl;
+    int MotionFatigueTc = Ctx->MotionFatigueTc;
 
     if (Verbosity > 1){
         printf("Scaled difference array (%d x %d)\n", widthSc, heightSc);
@@ -391,13 +1108,11 @@ static TriggerInfo_t AnalyzeDifferences(Region_t Region, int threshold, int Upda
 
     if (MotionFatigueTc == 0){
         // No motion fatigure applid, both returns are identical.
-        TriggerInfo_t retval = LocateMotion(DiffScaled);
-        if (no_fatigue_motion) *no_fatigue_motion = retval;
-        return retval;
+        return LocateMotion(Ctx, DiffScaled, no_fatigue_motion);
     }else{
         if (no_fatigue_motion){
             // Additional detection prior to motion fatigue.
-            *no_fatigue_motion = LocateMotion(DiffScaled);
+            LocateMotion(Ctx, DiffScaled, no_fatigue_motion);
         }
     }
 
@@ -410,7 +1125,6 @@ static TriggerInfo_t AnalyzeDifferences(Region_t Region, int threshold, int Upda
     }
 
     if (UpdateFatigue){
-        static int SinceFatiguePrint = 0;
         int FatigueAverage;
         // Compute motion fatigue
         FatigueAverage = 0;
@@ -426,32 +1140,406 @@ static TriggerInfo_t AnalyzeDifferences(Region_t Region, int threshold, int Upda
         FatigueAverage = FatigueAverage/(heightSc*widthSc); // Divide by array size to get average.
 
         // Print fatigue map to log from time to time.
-        if (Verbosity > 1 || (FatigueAverage > 50 && SinceFatiguePrint > 60)){
+        if (Verbosity > 1 || (FatigueAverage > 50 && Ctx->SinceFatiguePrint > 60)){
             // Print the fatigure array every minuts if there is stuff in it.
             fprintf(Log, "Fatigue map (%d x %d) sum=%d<small>\n", widthSc, heightSc, FatigueAverage);
             ShowImgMap(Fatigue, 50);
             fprintf(Log, "</small>\n");
-            SinceFatiguePrint = 0;
+            Ctx->SinceFatiguePrint = 0;
         }
-        SinceFatiguePrint++;
+        Ctx->SinceFatiguePrint++;
     }
  
     if (SkipFatigue == 0){
-        // Subtract out motion fatigue
-        int fatmult = FatigueGainPercent * 3 * 256 / 100;
+        // Subtract out motion fatigue.  Into another map, so DiffScaled stays as it was
+        // for RecheckPix.
+        int fatmult = Ctx->FatigueGainPercent * 3 * 256 / 100;
         for (int row=0;row<heightSc;row++){
             for (int col=0;col<widthSc;col++){
                 int FatSub = (FatigueBl->values[row*widthSc+col] * fatmult) >> 8;
                 int ds = DiffScaled->values[row*widthSc+col] - FatSub;
                 if (ds < 0) ds = 0;
-                DiffScaled->values[row*widthSc+col] = ds;
+                Ctx->Fatigued->values[row*widthSc+col] = ds;
             }
         }
+        DiffScaled = Ctx->Fatigued;
     }
 
 
-    TriggerInfo_t retval = LocateMotion(DiffScaled);
+    TriggerInfo_t retval = LocateMotion(Ctx, DiffScaled, NULL);
 
     return retval;
 }
 
+
+// How many cells beyond the window size to look at around the previous motion
+#define RECHECK_MARGIN 4
+
+//----------------------------------------------------------------------------------------
+// Find out if the differences between pic1 and pic2 still amount to motion around
+// where motion was found before, computing differences only for the cells around it.
+// pic1 is two pictures before pic2, and the last two compares were pic1 to the picture
+// in between, and that one to pic2.  Returns 1 with Result filled in if that settles it,
+// 0 if it takes a full compare.
+//
+// The threshold comes from the histogram of the last compare, with the area around
+// the motion swapped for what it is now.  For the rest of the image, the differences
+// are taken to be at most those the last two compares found there added up, as they
+// would be if differences added up from picture to picture.  Brightness normalizing
+// and the threshold keep that from being exactly so, which leaves a small chance of
+// a different answer than the full compare.
+//----------------------------------------------------------------------------------------
+static int RecheckLocal(CompareContext_t * Ctx, MemImage_t * pic1, MemImage_t * pic2, Region_t Region,
+        int DetectionPixels, int m1i, int m2i, double BrightnessRatio, TriggerInfo_t Around, TriggerInfo_t * Result)
+{
+    ScaledFrom_t * Last = &Ctx->DiffFrom, * Before = &Ctx->PrevFrom;
+    if (Last->pic2 != pic2 || Last->pic1 != Before->pic2 || Before->pic1 != pic1) return 0;
+
+    Region_t Local;
+    int cellpix = scalef*Ctx->ScaleDenom;
+    int Sensitivity = Ctx->Sensitivity;
+    DiffMap_t * DiffVal = Ctx->DiffVal;
+    WeightMap_t * WeightMap = Ctx->WeightMap;
+    int width = DiffVal->w;
+    int nc = pic1->components;
+    DiffRowFunc_t DiffRow = PickDiffRow(nc, 0);
+    int widthSc = Ctx->widthSc;
+
+    // Cells around where the motion was, plus a margin.
+    int acol = (Around.x-cellpix/2) / cellpix;
+    int arow = (Around.y-cellpix/2) / cellpix;
+    Local.x1 = (acol-wind_w-RECHECK_MARGIN)*scalef;
+    Local.x2 = (acol+wind_w+RECHECK_MARGIN+1)*scalef;
+    Local.y1 = (arow-wind_h-RECHECK_MARGIN)*scalef;
+    Local.y2 = (arow+wind_h+RECHECK_MARGIN+1)*scalef;
+    if (Local.x1 < Region.x1) Local.x1 = Region.x1;
+    if (Local.x2 > Region.x2) Local.x2 = Region.x2;
+    if (Local.y1 < Region.y1) Local.y1 = Region.y1;
+    if (Local.y2 > Region.y2) Local.y2 = Region.y2;
+    if (Local.x2 < Local.x1) Local.x2 = Local.x1;
+    if (Local.y2 < Local.y1) Local.y2 = Local.y1;
+
+    // Differences around the motion, in place of the last compare's.
+    int Hist[256];
+    memcpy(Hist, Last->Hist, sizeof(Hist));
+    for (int row=Local.y1;row<Local.y2;row++){
+        for (Span_t * sp = FIRST_SPAN(WeightMap, row); sp < END_SPAN(WeightMap, row); sp++){
+            int x1 = sp->x1 > Local.x1 ? sp->x1 : Local.x1;
+            int x2 = sp->x2 < Local.x2 ? sp->x2 : Local.x2;
+            if (x2 <= x1) continue;
+            int offset = row*width + x1;
+            for (int a=0;a<x2-x1;a++) Hist[DiffVal->values[offset+a]] -= 1;
+            if (pic1->Ycc){
+                DiffSpanYcc(pic1, pic2, row, x1, x2, m1i, m2i, &DiffVal->values[offset], Hist, NULL, Ctx->YccRows);
+            }else{
+                DiffRow(pic1->pixels+offset*nc, pic2->pixels+offset*nc, x2-x1, m1i, m2i,
+                    &DiffVal->values[offset], Hist, NULL);
+            }
+        }
+    }
+    // DiffVal is a mix of two compares now.
+    Last->pic1 = Last->pic2 = NULL;
+
+    int threshold = CalcThreshold(Hist, DetectionPixels, BrightnessRatio);
+    ScaleDifferences(Ctx, Ctx->LocalScaled, Local, threshold, NULL);
+    TriggerInfo_t LocalTrig = LocateMotion(Ctx, Ctx->LocalScaled, NULL);
+    if (LocalTrig.DiffLevel >= Sensitivity){
+        // Motion around there alone is enough.
+        *Result = LocalTrig;
+        return 1;
+    }
+
+    // Fill in the rest with what the last two compares found, taken to this threshold.
+    // A lower threshold adds at most the difference in thresholds for each pixel.
+    ImgMap_t * CellWeight = GetCellWeight(Ctx, Region);
+    int Lower = (Last->Threshold > threshold ? Last->Threshold-threshold : 0)
+              + (Before->Threshold > threshold ? Before->Threshold-threshold : 0);
+    int c1 = Local.x1/scalef, c2 = ROOF_SC(Local.x2), r1 = Local.y1/scalef, r2 = ROOF_SC(Local.y2);
+    for (int row=0;row<Ctx->heightSc;row++){
+        for (int col=0;col<widthSc;col++){
+            if (row >= r1 && row < r2 && col >= c1 && col < c2) continue;
+            int a = row*widthSc+col;
+            Ctx->LocalScaled->values[a] = Ctx->DiffScaled->values[a] + Ctx->PrevScaled->values[a]
+                    + Lower*CellWeight->values[a];
+        }
+    }
+    int maxc, maxr;
+    int maxval = BlockFilterImgMap(Ctx->LocalScaled, Ctx->Filtered, wind_w, wind_h, &maxc, &maxr);
+    if (maxval < Sensitivity*100){
+        // Not enough for motion even with that.
+        *Result = LocalTrig;
+        return 1;
+    }
+
+    if (Verbosity) printf("Recheck around motion not conclusive, check whole image\n");
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+// Free what was worked out about a picture.
+//----------------------------------------------------------------------------------------
+void FreeFrameFeatures(FrameFeatures_t * feat)
+{
+    FreeMemImage(feat->Coarse);
+    memset(feat, 0, sizeof(FrameFeatures_t));
+}
+
+//----------------------------------------------------------------------------------------
+// Scratch sums for making coarse copies.  Kept per thread, as coarse copies also get
+// made on decode threads, and only allocated again if pictures get bigger.  Too big to
+// go on the stack of those threads.
+//----------------------------------------------------------------------------------------
+static int * CoarseScratch(int Num)
+{
+    static __thread int * Scratch = NULL;
+    static __thread int Allocated = 0;
+    if (Num > Allocated){
+        free(Scratch);
+        Scratch = malloc(sizeof(int)*Num);
+        if (Scratch == NULL){
+            fprintf(stderr, "Coarse scratch malloc failed\n");
+            exit(-1);
+        }
+        Allocated = Num;
+        COUNT_FRAME_ALLOC();
+    }
+    return Scratch;
+}
+
+//----------------------------------------------------------------------------------------
+// Make a copy of a picture averaged over blocks of scalef x scalef pixels, so that
+// each pixel of it covers one cell of DiffScaled.  Brightness over the detection region
+// gets worked out too, if it isn't known yet.
+//----------------------------------------------------------------------------------------
+static MemImage_t * MakeCoarse(CompareContext_t * Ctx, MemImage_t * pic, Region_t MainReg, FrameFeatures_t * feat)
+{
+    int w = ROOF_SC(pic->width);
+    int h = ROOF_SC(pic->height);
+    int nc = pic->components;
+    int rowbytes = pic->width*nc;
+    int * sums = CoarseScratch(rowbytes);
+    MemImage_t * Coarse = NewMemImage(w, h, nc, 0); // Coarse compare only looks at luma of Ycc pictures.
+    double BrightSum = 0;
+    int BrightPixels = 0;
+
+    for (int r=0;r<h;r++){
+        int y1 = r*scalef;
+        int y2 = y1+scalef < pic->height ? y1+scalef : pic->height;
+        unsigned char * dst = Coarse->pixels+r*w*nc;
+
+        // Add up the rows of the block first (the compiler vectorizes this)
+        memset(sums, 0, sizeof(int)*rowbytes);
+        for (int y=y1;y<y2;y++){
+            unsigned char * p = pic->pixels+y*rowbytes;
+            for (int a=0;a<rowbytes;a++) sums[a] += p[a];
+            if (!feat->HaveBright && y >= MainReg.y1 && y < MainReg.y2){
+                // While the row is still in the cache.
+                Region_t Row = MainReg;
+                int n;
+                Row.y1 = y;
+                Row.y2 = y+1;
+                BrightSum += SumBright(pic, Row, Ctx->WeightMap, &n);
+                BrightPixels += n;
+            }
+        }
+
+        // Then the columns.
+        for (int c=0;c<w;c++){
+            int x1 = c*scalef;
+            int x2 = x1+scalef < pic->width ? x1+scalef : pic->width;
+            int n = (x2-x1)*(y2-y1);
+            for (int k=0;k<nc;k++){
+                int s = 0;
+                for (int x=x1;x<x2;x++) s += sums[x*nc+k];
+                dst[c*nc+k] = (s+n/2)/n;
+            }
+        }
+    }
+
+    if (!feat->HaveBright){
+        feat->Bright = BrightFromSum(BrightSum, BrightPixels);
+        feat->HaveBright = 1;
+    }
+    return Coarse;
+}
+
+//----------------------------------------------------------------------------------------
+// Sum of pixel weights in each cell of DiffScaled.
+//----------------------------------------------------------------------------------------
+static ImgMap_t * GetCellWeight(CompareContext_t * Ctx, Region_t MainReg)
+{
+    AllocScaledMaps(Ctx);
+    int widthSc = Ctx->widthSc, heightSc = Ctx->heightSc;
+    WeightMap_t * WeightMap = Ctx->WeightMap;
+
+    ImgMap_t * CellWeight = Ctx->CellWeight;
+    if (CellWeight == NULL){
+        CellWeight = Ctx->CellWeight = MakeImgMap(widthSc, heightSc);
+        for (int row=MainReg.y1;row<MainReg.y2;row++){
+            int * cwrow = &CellWeight->values[widthSc*(row/scalef)];
+            for (Span_t * sp = FIRST_SPAN(WeightMap, row); sp < END_SPAN(WeightMap, row); sp++){
+                int x1 = sp->x1 > MainReg.x1 ? sp->x1 : MainReg.x1;
+                int x2 = sp->x2 < MainReg.x2 ? sp->x2 : MainReg.x2;
+                for (int col=x1;col<x2;col++) cwrow[col/scalef] += sp->weight;
+            }
+        }
+    }
+    return CellWeight;
+}
+
+//----------------------------------------------------------------------------------------
+// Pyramid mode.  Compare block averaged copies of the pictures, estimating the scaled down
+// differences from that.  If that's clearly not enough for motion (under Percent of
+// sensitivity), use the estimate and return 1.  Otherwise return 0 to do a full compare.
+// Only used with motion fatigue off, so there is no fatigue map to keep up.
+//----------------------------------------------------------------------------------------
+static int CoarseCompare(CompareContext_t * Ctx, FrameFeatures_t * feat1, FrameFeatures_t * feat2,
+        Region_t MainReg, int m1i, int m2i, double BrightnessRatio,
+        TriggerList_t * no_fatigue_motion, int Percent, TriggerInfo_t * Result)
+{
+    int DiffHist[256] = {0};
+    int ScratchHist[256];
+    int Cells = 0;
+
+    ImgMap_t * CellWeight = GetCellWeight(Ctx, MainReg);
+    int widthSc = Ctx->widthSc, heightSc = Ctx->heightSc;
+    ImgMap_t * DiffScaled = Ctx->DiffScaled;
+
+    if (feat1->Coarse->components != feat2->Coarse->components) return 0;
+
+    // Differences of the block averages, one per cell.  Not something to recheck from.
+    Ctx->DiffFrom.pic1 = Ctx->DiffFrom.pic2 = NULL;
+    int nc = feat1->Coarse->components;
+    DiffRowFunc_t DiffRow = PickDiffRow(nc, 0);
+    unsigned char CoarseDiff[widthSc];
+    for (int row=0;row<heightSc;row++){
+        int * cwrow = &CellWeight->values[widthSc*row];
+        int * dsrow = &DiffScaled->values[widthSc*row];
+        DiffRow(feat1->Coarse->pixels+row*widthSc*nc, feat2->Coarse->pixels+row*widthSc*nc,
+            widthSc, m1i, m2i, CoarseDiff, ScratchHist, NULL);
+        for (int col=0;col<widthSc;col++){
+            if (cwrow[col]){
+                DiffHist[CoarseDiff[col]] += 1;
+                Cells += 1;
+            }
+            dsrow[col] = CoarseDiff[col];
+        }
+    }
+    if (Cells == 0) return 0;
+
+    int threshold = CalcThreshold(DiffHist, Cells, BrightnessRatio);
+
+    // Estimate of what summing up the differences in each cell would give.
+    for (int a=0;a<widthSc*heightSc;a++){
+        int d = DiffScaled->values[a] - threshold;
+        DiffScaled->values[a] = d > 0 ? d * CellWeight->values[a] : 0;
+    }
+
+    int maxc, maxr;
+    int maxval = BlockFilterImgMap(DiffScaled, Ctx->Filtered, wind_w, wind_h, &maxc, &maxr);
+    if (maxval >= Ctx->Sensitivity*Percent){
+        if (Verbosity) printf("Coarse compare found %d, compare at full resolution\n", maxval/100);
+        return 0;
+    }
+
+    if (Verbosity) printf("Coarse compare found %d, no full compare needed\n", maxval/100);
+    *Result = FatigueAndLocate(Ctx, 0, 0, no_fatigue_motion);
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+// Make a coarse copy like MakeCoarse would, from the jpeg's block averages.  Each cell
+// averages the blocks whose centers fall in it.  Cells smaller than a block (at small
+// scale_denom) take the block that covers their center.
+//----------------------------------------------------------------------------------------
+static MemImage_t * CoarseFromDc(MemImage_t * Dc, int width, int height, int ScaleDenom)
+{
+    int w = ROOF_SC(width);
+    int h = ROOF_SC(height);
+    int * sums = CoarseScratch(w*h*2);
+    int * counts = sums+w*h;
+    MemImage_t * Coarse = NewMemImage(w, h, 1, 0);
+
+    memset(sums, 0, sizeof(int)*w*h*2);
+    for (int by=0;by<Dc->height;by++){
+        int r = (by*8+4)/ScaleDenom/scalef;
+        if (r >= h) break;
+        for (int bx=0;bx<Dc->width;bx++){
+            int c = (bx*8+4)/ScaleDenom/scalef;
+            if (c >= w) break;
+            sums[r*w+c] += Dc->pixels[by*Dc->width+bx];
+            counts[r*w+c] += 1;
+        }
+    }
+
+    for (int r=0;r<h;r++){
+        for (int c=0;c<w;c++){
+            int n = counts[r*w+c];
+            if (n){
+                Coarse->pixels[r*w+c] = (sums[r*w+c]+n/2)/n;
+            }else{
+                int bx = (c*scalef+scalef/2)*ScaleDenom/8;
+                int by = (r*scalef+scalef/2)*ScaleDenom/8;
+                if (bx >= Dc->width) bx = Dc->width-1;
+                if (by >= Dc->height) by = Dc->height-1;
+                Coarse->pixels[r*w+c] = Dc->pixels[by*Dc->width+bx];
+            }
+        }
+    }
+    return Coarse;
+}
+
+//----------------------------------------------------------------------------------------
+// Fill in a picture's coarse copy from its jpeg's DC coefficients, without decoding it.
+// Returns 0 if that couldn't be done.
+//----------------------------------------------------------------------------------------
+int LoadDcFeatures(FileData_t * File, int scale_denom, int ParseExif, FrameFeatures_t * feat)
+{
+    int width, height;
+    MemImage_t * Dc = LoadJPEGDc(File, scale_denom, ParseExif, &width, &height);
+    if (Dc == NULL) return 0;
+
+    FreeFrameFeatures(feat);
+    feat->Coarse = CoarseFromDc(Dc, width, height, scale_denom);
+    feat->Width = width;
+    feat->Height = height;
+    FreeMemImage(Dc);
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+// Compare two pictures from just their DC coefficient coarse copies.  If there's clearly
+// not enough change, fill in Result from the estimate and return 1.  Otherwise return 0,
+// and the pictures need decoding for ComparePix.
+//----------------------------------------------------------------------------------------
+int DcPrefilter(CompareContext_t * Ctx, FrameFeatures_t * feat1, FrameFeatures_t * feat2,
+        TriggerList_t * no_fatigue_motion, TriggerInfo_t * Result)
+{
+    Region_t MainReg;
+    double m1, m2, BrightnessRatio;
+
+    if (feat1->Coarse == NULL || feat2->Coarse == NULL || !feat1->Width
+        || feat1->Width != feat2->Width || feat1->Height != feat2->Height) return 0;
+
+    if (!AllocWorkingMaps(Ctx, feat1->Width, feat1->Height)) return 0;
+    if (GetMainRegion(Ctx, feat1->Width, feat1->Height, &MainReg) == 0) return 0;
+
+    // Brightness of the detection region, going by the cells it covers.
+    ImgMap_t * CellWeight = GetCellWeight(Ctx, MainReg);
+    double Sum1 = 0, Sum2 = 0, Weights = 0;
+    for (int a=0;a<CellWeight->w*CellWeight->h;a++){
+        int cw = CellWeight->values[a];
+        Sum1 += feat1->Coarse->pixels[a] * cw;
+        Sum2 += feat2->Coarse->pixels[a] * cw;
+        Weights += cw;
+    }
+    if (Weights == 0) return 0;
+    double b1average = Sum1/Weights, b2average = Sum2/Weights;
+
+    Ctx->NewestAverageBright = (int)(b2average+0.5);
+    if (Verbosity) printf("\nDC prefilter, average bright: %f %f\n", b1average, b2average);
+
+    CalcMultipliers(b1average, b2average, &m1, &m2, &BrightnessRatio);
+    return CoarseCompare(Ctx, feat1, feat2, MainReg, (int)(m1*256+0.5), (int)(m2*256+0.5), BrightnessRatio,
+            no_fatigue_motion, Ctx->DctPercent, Result);
+}
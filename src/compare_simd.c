@@ -0,0 +1,292 @@
+//-----------------------------------------------------------------------------------
+// SIMD versions of the ComparePix difference kernel, picked at startup based on
+// what the CPU supports.  These must produce exactly the same difference values
+// and histogram as DiffRowScalar() in compare.c, so detection doesn't change.
+//
+// Imgcomp is licensed under GPL v2 (see README.txt)
+//-----------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "imgcomp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define HAVE_X86_KERNELS
+    #include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+    #define HAVE_NEON_KERNEL
+    #include <arm_neon.h>
+    #if defined(__arm__)
+        #include <sys/auxv.h>
+        #include <asm/hwcap.h>
+    #endif
+#endif
+
+DiffRowFunc_t DiffRowKernel = DiffRowScalar;
+
+// A note on exactness:
+// The scalar kernel does an integer divide of the composite difference by the local
+// brightness.  The numerator is at most 2550*120, well under 2^24, so single precision
+// division followed by truncation gives the same quotient.  m1i and m2i are at most
+// 2.5*256, so they fit in 16 bits.
+//
+// The scalar kernel only compares the second picture's green and blue against the
+// first picture's (already multiplied) maximum.  The kernels here do the same thing.
+// Excluded pixels get a difference of zero, then get taken back out of histogram bin 0.
+
+#ifdef HAVE_X86_KERNELS
+#ifdef __SSE2__
+//----------------------------------------------------------------------------------------
+// SSE2 helpers.  SSE2 lacks 32 bit max, min and abs.
+//----------------------------------------------------------------------------------------
+static inline __m128i Max32_sse2(__m128i a, __m128i b)
+{
+    __m128i gt = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+static inline __m128i Abs32_sse2(__m128i a)
+{
+    __m128i sign = _mm_srai_epi32(a, 31);
+    return _mm_sub_epi32(_mm_xor_si128(a, sign), sign);
+}
+
+//----------------------------------------------------------------------------------------
+// Four pixels worth of the difference computation, on 32 bit values.
+//----------------------------------------------------------------------------------------
+static inline __m128i DiffQuad_sse2(__m128i r1m, __m128i g1m, __m128i b1m, __m128i max1m,
+                                    __m128i r2m, __m128i g2m, __m128i b2m, __m128i g2, __m128i b2)
+{
+    __m128i max, dr, dg, db, d;
+    max = Max32_sse2(Max32_sse2(max1m, g2), b2);
+    max = _mm_srai_epi32(Max32_sse2(max, r2m), 8);
+    max = Max32_sse2(max, _mm_set1_epi32(40));
+
+    dr = Abs32_sse2(_mm_sub_epi32(r1m, r2m));
+    dg = Abs32_sse2(_mm_sub_epi32(g1m, g2m));
+    db = Abs32_sse2(_mm_sub_epi32(b1m, b2m));
+    d = _mm_add_epi32(_mm_add_epi32(dr, db), _mm_slli_epi32(dg, 1));
+    d = _mm_srai_epi32(d, 8);
+    d = _mm_sub_epi32(_mm_slli_epi32(d, 7), _mm_slli_epi32(d, 3)); // times 120
+
+    d = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(d), _mm_cvtepi32_ps(max)));
+
+    __m128i gt = _mm_cmpgt_epi32(d, _mm_set1_epi32(255));
+    return _mm_or_si128(_mm_andnot_si128(gt, d), _mm_and_si128(gt, _mm_set1_epi32(255)));
+}
+
+//----------------------------------------------------------------------------------------
+// SSE2 has no byte shuffle, so pixels are gathered into 16 bit lanes.
+//----------------------------------------------------------------------------------------
+#define GATHER8(p) _mm_setr_epi16(p[0],p[3],p[6],p[9],p[12],p[15],p[18],p[21])
+
+static void DiffRowSse2(const unsigned char * p1, const unsigned char * p2,
+        int n, int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i m1 = _mm_set1_epi16(m1i);
+    const __m128i m2 = _mm_set1_epi16(m2i);
+    int col;
+
+    // 16x16 bit multiply, giving 32 bit products for lanes 0-3 and 4-7
+    #define MUL_LO(a,m) _mm_unpacklo_epi16(_mm_mullo_epi16(a,m), _mm_mulhi_epu16(a,m))
+    #define MUL_HI(a,m) _mm_unpackhi_epi16(_mm_mullo_epi16(a,m), _mm_mulhi_epu16(a,m))
+
+    for (col=0;col+8<=n;col+=8){
+        __m128i r1 = GATHER8(p1), g1 = GATHER8((p1+1)), b1 = GATHER8((p1+2));
+        __m128i r2 = GATHER8(p2), g2 = GATHER8((p2+1)), b2 = GATHER8((p2+2));
+        __m128i max1 = _mm_max_epi16(r1, _mm_max_epi16(g1, b1));
+        __m128i dlo, dhi;
+
+        dlo = DiffQuad_sse2(MUL_LO(r1,m1), MUL_LO(g1,m1), MUL_LO(b1,m1), MUL_LO(max1,m1),
+                            MUL_LO(r2,m2), MUL_LO(g2,m2), MUL_LO(b2,m2),
+                            _mm_unpacklo_epi16(g2, zero), _mm_unpacklo_epi16(b2, zero));
+        dhi = DiffQuad_sse2(MUL_HI(r1,m1), MUL_HI(g1,m1), MUL_HI(b1,m1), MUL_HI(max1,m1),
+                            MUL_HI(r2,m2), MUL_HI(g2,m2), MUL_HI(b2,m2),
+                            _mm_unpackhi_epi16(g2, zero), _mm_unpackhi_epi16(b2, zero));
+
+        _mm_storel_epi64((__m128i *)(diffrow+col), _mm_packus_epi16(_mm_packs_epi32(dlo, dhi), zero));
+        for (int a=0;a<8;a++) DiffHist[diffrow[col+a]] += 1;
+
+        p1 += 24;
+        p2 += 24;
+    }
+    #undef MUL_LO
+    #undef MUL_HI
+
+    DiffRowScalar(p1, p2, n-col, m1i, m2i, diffrow+col, DiffHist, NULL);
+}
+#undef GATHER8
+#endif // __SSE2__
+
+//----------------------------------------------------------------------------------------
+// AVX2 kernel.  Uses byte shuffles to separate red, green and blue of 8 pixels.
+//----------------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+static inline __m256i Load8Chan_avx2(__m128i lo, __m128i hi, int chan)
+{
+    // lo holds bytes 0-15 of the 8 pixels, hi holds bytes 16-23.
+    __m128i ShufLo = _mm_setr_epi8(chan, chan+3, chan+6, chan+9, chan+12,
+                                   chan < 1 ? 15 : -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i ShufHi = _mm_setr_epi8(-1, -1, -1, -1, -1,
+                                   chan < 1 ? -1 : chan-1, chan+2, chan+5, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i v = _mm_or_si128(_mm_shuffle_epi8(lo, ShufLo), _mm_shuffle_epi8(hi, ShufHi));
+    return _mm256_cvtepu8_epi32(v);
+}
+
+__attribute__((target("avx2")))
+static void DiffRowAvx2(const unsigned char * p1, const unsigned char * p2,
+        int n, int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd)
+{
+    const __m256i m1 = _mm256_set1_epi32(m1i);
+    const __m256i m2 = _mm256_set1_epi32(m2i);
+    int col;
+
+    for (col=0;col+8<=n;col+=8){
+        __m128i lo1 = _mm_loadu_si128((const __m128i *)p1);
+        __m128i hi1 = _mm_loadl_epi64((const __m128i *)(p1+16));
+        __m128i lo2 = _mm_loadu_si128((const __m128i *)p2);
+        __m128i hi2 = _mm_loadl_epi64((const __m128i *)(p2+16));
+        __m256i r1 = Load8Chan_avx2(lo1, hi1, 0);
+        __m256i g1 = Load8Chan_avx2(lo1, hi1, 1);
+        __m256i b1 = Load8Chan_avx2(lo1, hi1, 2);
+        __m256i r2 = Load8Chan_avx2(lo2, hi2, 0);
+        __m256i g2 = Load8Chan_avx2(lo2, hi2, 1);
+        __m256i b2 = Load8Chan_avx2(lo2, hi2, 2);
+        __m256i max, dr, dg, db, d;
+        __m128i d128;
+
+        max = _mm256_mullo_epi32(_mm256_max_epi32(r1, _mm256_max_epi32(g1, b1)), m1);
+        max = _mm256_max_epi32(_mm256_max_epi32(max, g2), b2);
+        max = _mm256_srai_epi32(_mm256_max_epi32(max, _mm256_mullo_epi32(r2, m2)), 8);
+        max = _mm256_max_epi32(max, _mm256_set1_epi32(40));
+
+        dr = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(r1, m1), _mm256_mullo_epi32(r2, m2)));
+        dg = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(g1, m1), _mm256_mullo_epi32(g2, m2)));
+        db = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(b1, m1), _mm256_mullo_epi32(b2, m2)));
+        d = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(dr, db), _mm256_slli_epi32(dg, 1)), 8);
+        d = _mm256_mullo_epi32(d, _mm256_set1_epi32(120));
+        d = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(d), _mm256_cvtepi32_ps(max)));
+        d = _mm256_min_epi32(d, _mm256_set1_epi32(255));
+
+        d128 = _mm_packs_epi32(_mm256_castsi256_si128(d), _mm256_extracti128_si256(d, 1));
+        _mm_storel_epi64((__m128i *)(diffrow+col), _mm_packus_epi16(d128, d128));
+        for (int a=0;a<8;a++) DiffHist[diffrow[col+a]] += 1;
+
+        p1 += 24;
+        p2 += 24;
+    }
+
+    DiffRowScalar(p1, p2, n-col, m1i, m2i, diffrow+col, DiffHist, NULL);
+}
+#endif // HAVE_X86_KERNELS
+
+#ifdef HAVE_NEON_KERNEL
+//----------------------------------------------------------------------------------------
+// Unsigned 32 bit divide.  ARMv7 NEON has no divide, so multiply by a reciprocal
+// estimate and then correct the quotient, which can be off by one either way.
+//----------------------------------------------------------------------------------------
+static inline uint32x4_t Div32_neon(uint32x4_t num, uint32x4_t den)
+{
+    float32x4_t denf = vcvtq_f32_u32(den);
+    float32x4_t recip = vrecpeq_f32(denf);
+    recip = vmulq_f32(vrecpsq_f32(denf, recip), recip);
+    recip = vmulq_f32(vrecpsq_f32(denf, recip), recip);
+    uint32x4_t q = vcvtq_u32_f32(vmulq_f32(vcvtq_f32_u32(num), recip));
+
+    int32x4_t rem = vreinterpretq_s32_u32(vsubq_u32(num, vmulq_u32(q, den)));
+    q = vaddq_u32(q, vcltq_s32(rem, vdupq_n_s32(0)));                   // Too big, -1
+    q = vsubq_u32(q, vcgeq_s32(rem, vreinterpretq_s32_u32(den)));        // Too small, +1
+    return q;
+}
+
+//----------------------------------------------------------------------------------------
+// Four pixels worth of the difference computation.
+//----------------------------------------------------------------------------------------
+static inline uint32x4_t DiffQuad_neon(uint16x4_t r1, uint16x4_t g1, uint16x4_t b1, uint16x4_t max1,
+                                       uint16x4_t r2, uint16x4_t g2, uint16x4_t b2,
+                                       uint16_t m1i, uint16_t m2i)
+{
+    uint32x4_t r2m = vmull_n_u16(r2, m2i);
+    uint32x4_t max, dr, dg, db, d;
+
+    max = vmaxq_u32(vmull_n_u16(max1, m1i), vmovl_u16(g2));
+    max = vmaxq_u32(max, vmovl_u16(b2));
+    max = vshrq_n_u32(vmaxq_u32(max, r2m), 8);
+    max = vmaxq_u32(max, vdupq_n_u32(40));
+
+    dr = vabdq_u32(vmull_n_u16(r1, m1i), r2m);
+    dg = vabdq_u32(vmull_n_u16(g1, m1i), vmull_n_u16(g2, m2i));
+    db = vabdq_u32(vmull_n_u16(b1, m1i), vmull_n_u16(b2, m2i));
+    d = vshrq_n_u32(vaddq_u32(vaddq_u32(dr, db), vshlq_n_u32(dg, 1)), 8);
+    d = Div32_neon(vmulq_n_u32(d, 120), max);
+    return vminq_u32(d, vdupq_n_u32(255));
+}
+
+//----------------------------------------------------------------------------------------
+// NEON kernel.  vld3 separates red, green and blue for us.
+//----------------------------------------------------------------------------------------
+static void DiffRowNeon(const unsigned char * p1, const unsigned char * p2,
+        int n, int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd)
+{
+    int col;
+
+    for (col=0;col+8<=n;col+=8){
+        uint8x8x3_t a = vld3_u8(p1);
+        uint8x8x3_t b = vld3_u8(p2);
+        uint16x8_t r1 = vmovl_u8(a.val[0]), g1 = vmovl_u8(a.val[1]), b1 = vmovl_u8(a.val[2]);
+        uint16x8_t r2 = vmovl_u8(b.val[0]), g2 = vmovl_u8(b.val[1]), b2 = vmovl_u8(b.val[2]);
+        uint16x8_t max1 = vmovl_u8(vmax_u8(a.val[0], vmax_u8(a.val[1], a.val[2])));
+        uint32x4_t dlo, dhi;
+
+        dlo = DiffQuad_neon(vget_low_u16(r1), vget_low_u16(g1), vget_low_u16(b1), vget_low_u16(max1),
+                            vget_low_u16(r2), vget_low_u16(g2), vget_low_u16(b2), m1i, m2i);
+        dhi = DiffQuad_neon(vget_high_u16(r1), vget_high_u16(g1), vget_high_u16(b1), vget_high_u16(max1),
+                            vget_high_u16(r2), vget_high_u16(g2), vget_high_u16(b2), m1i, m2i);
+
+        vst1_u8(diffrow+col, vmovn_u16(vcombine_u16(vmovn_u32(dlo), vmovn_u32(dhi))));
+        for (int a=0;a<8;a++) DiffHist[diffrow[col+a]] += 1;
+
+        p1 += 24;
+        p2 += 24;
+    }
+
+    DiffRowScalar(p1, p2, n-col, m1i, m2i, diffrow+col, DiffHist, NULL);
+}
+#endif // HAVE_NEON_KERNEL
+
+//----------------------------------------------------------------------------------------
+// Pick the fastest difference kernel this CPU can run.
+//----------------------------------------------------------------------------------------
+void SelectDiffKernel(void)
+{
+    const char * Name = "scalar";
+    DiffRowKernel = DiffRowScalar;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        DiffRowKernel = DiffRowAvx2;
+        Name = "avx2";
+    }
+    #ifdef __SSE2__
+    else if (__builtin_cpu_supports("sse2")){
+        DiffRowKernel = DiffRowSse2;
+        Name = "sse2";
+    }
+    #endif
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+    #if defined(__arm__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+    #endif
+    {
+        DiffRowKernel = DiffRowNeon;
+        Name = "neon";
+    }
+#endif
+
+    if (Verbosity) printf("Using %s difference kernel\n", Name);
+}
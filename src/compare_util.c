@@ -15,10 +15,21 @@
 #include "config.h"
 
 //#define Log stdout
+//----------------------------------------------------------------------------------------
+// Look up weight of one pixel in the weight map.
+//----------------------------------------------------------------------------------------
+static int WeightAt(WeightMap_t * Map, int row, int col)
+{
+    for (Span_t * sp = FIRST_SPAN(Map, row); sp < END_SPAN(Map, row); sp++){
+        if (col >= sp->x1 && col < sp->x2) return sp->weight;
+    }
+    return 0;
+}
+
 //----------------------------------------------------------------------------------------
 // Show detection weight map array.
 //----------------------------------------------------------------------------------------
-static void ShowWeightMap(ImgMap_t * WeightMap)
+static void ShowWeightMap(WeightMap_t * WeightMap)
 {
     int row, width, height;
     width = WeightMap->w;
@@ -30,88 +41,149 @@ static void ShowWeightMap(ImgMap_t * WeightMap)
         int r;
         printf("  ");
         for (r=skip/2;r<width;r+=skip){
-            switch (WeightMap->values[row*width+r]){
+            int w = WeightAt(WeightMap, row, r);
+            switch (w){
                 case 0: putchar('-');break;
                 case 1: putchar('1');break;
                 case 2: putchar('#');break;
                 default: 
-				printf(" %d",WeightMap->values[row*width+r]);
+				printf(" %d",w);
 				putchar('?'); break;
             }
         }
         printf("\n");
     }
+    printf("Weight map has %d spans\n", WeightMap->NumSpans);
+}
+
+//----------------------------------------------------------------------------------------
+// Allocate an empty weight map.  Rows get added in order with AddRowSpans.
+//----------------------------------------------------------------------------------------
+static WeightMap_t * NewWeightMap(int width, int height)
+{
+    WeightMap_t * Map = malloc(sizeof(WeightMap_t));
+    Map->w = width;
+    Map->h = height;
+    Map->RowSpans = malloc(sizeof(int)*(height+1));
+    Map->RowSpans[0] = 0;
+    Map->NumSpans = 0;
+    Map->SpansAllocated = height;
+    Map->Spans = malloc(sizeof(Span_t)*height);
+    return Map;
+}
+
+//----------------------------------------------------------------------------------------
+// Turn a row of per pixel weights into spans and add them to the map.
+//----------------------------------------------------------------------------------------
+static void AddRowSpans(WeightMap_t * Map, int row, const unsigned char * Weights)
+{
+    for (int col=0;col<Map->w;){
+        int w = Weights[col];
+        int start = col;
+        while (col < Map->w && Weights[col] == w) col++;
+        if (w == 0) continue;
+
+        if (Map->NumSpans >= Map->SpansAllocated){
+            Map->SpansAllocated *= 2;
+            Map->Spans = realloc(Map->Spans, sizeof(Span_t)*Map->SpansAllocated);
+        }
+        Map->Spans[Map->NumSpans].x1 = start;
+        Map->Spans[Map->NumSpans].x2 = col;
+        Map->Spans[Map->NumSpans].weight = w;
+        Map->NumSpans += 1;
+    }
+    Map->RowSpans[row+1] = Map->NumSpans;
+}
+
+//----------------------------------------------------------------------------------------
+// Free weight map
+//----------------------------------------------------------------------------------------
+void FreeWeightMap(WeightMap_t * Map)
+{
+    if (Map == NULL) return;
+    free(Map->RowSpans);
+    free(Map->Spans);
+    free(Map);
 }
 
 //----------------------------------------------------------------------------------------
 // Turn exclude regions into an image map of what to use and not use.
+// Regions are clipped to the picture size here, the ones passed in stay as they are.
 //----------------------------------------------------------------------------------------
-void FillWeightMap(int width, int height)
+WeightMap_t * FillWeightMap(int width, int height, Regions_t * Regions)
 {
     int row, r;
     Region_t Reg;
+    Region_t Excludes[Regions->NumExcludeReg+1];
+    unsigned char RowWeights[width];
+    WeightMap_t * WeightMap;
 
-    WeightMap = malloc(offsetof(ImgMap_t, values) + sizeof(WeightMap->values[0])*width*height); // fixme - use init function
-    WeightMap->w = width; WeightMap->h = height;
+    WeightMap = NewWeightMap(width, height);
 
-    memset(WeightMap->values, 0,  sizeof(WeightMap->values)*width*height);
-
-    Reg = Regions.DetectReg;
+    Reg = Regions->DetectReg;
     if (Reg.x2 > width) Reg.x2 = width;
     if (Reg.y2 > height) Reg.y2 = height;
     printf("fill %d-%d,%d-%d\n",Reg.x1, Reg.x2, Reg.y1, Reg.y2);
-    for (row=Reg.y1;row<Reg.y2;row++){
-		int * rowP = &WeightMap->values[row*width];
-		for (int col=Reg.x1;col<Reg.x2;col++){
-			rowP[col] = 1;
-		}
+    for (r=0;r<Regions->NumExcludeReg;r++){
+        Region_t * Ex = &Excludes[r];
+        *Ex = Regions->ExcludeReg[r];
+        if (Ex->x2 > width) Ex->x2 = width;
+        if (Ex->y2 > height) Ex->y2 = height;
+        printf("clear %d-%d,%d-%d\n",Ex->x1, Ex->x2, Ex->y1, Ex->y2);
     }
 
-    for (r=0;r<Regions.NumExcludeReg;r++){
-        Reg=Regions.ExcludeReg[r];
-        if (Reg.x2 > width) Reg.x2 = width;
-        if (Reg.y2 > height) Reg.y2 = height;
-        printf("clear %d-%d,%d-%d\n",Reg.x1, Reg.x2, Reg.y1, Reg.y2);
-        for (row=Reg.y1;row<Reg.y2;row++){
-            memset(&WeightMap->values[row*width+Reg.x1], 0, Reg.x2-Reg.x1);
+    for (row=0;row<height;row++){
+        memset(RowWeights, 0, width);
+        if (row >= Reg.y1 && row < Reg.y2 && Reg.x2 > Reg.x1){
+            memset(RowWeights+Reg.x1, 1, Reg.x2-Reg.x1);
+
+            for (r=0;r<Regions->NumExcludeReg;r++){
+                Region_t Ex = Excludes[r];
+                if (row < Ex.y1 || row >= Ex.y2 || Ex.x2 <= Ex.x1) continue;
+                memset(RowWeights+Ex.x1, 0, Ex.x2-Ex.x1);
+            }
         }
+        AddRowSpans(WeightMap, row, RowWeights);
     }
     
     ShowWeightMap(WeightMap);
+    return WeightMap;
 }
 
 //----------------------------------------------------------------------------------------
 // Load the image to determine which regions to use and which to exclude.
+// The rows the map covers become the detection region.
 //----------------------------------------------------------------------------------------
-void ProcessDiffMap(MemImage_t * MapPic)
+WeightMap_t * ProcessDiffMap(MemImage_t * MapPic, Regions_t * Regions)
 {
+    WeightMap_t * WeightMap;
     int width, height, row, col;
     int firstrow, lastrow;
     int numred, numblue;
     width = MapPic->width;
     height = MapPic->height;
+    unsigned char RowWeights[width];
 
     // Allocate the detection region.
-    WeightMap = malloc(offsetof(ImgMap_t, values) 
-             + sizeof(WeightMap->values[0])*width*height);
-    WeightMap->w = width; 
-    WeightMap->h = height;
+    WeightMap = NewWeightMap(width, height);
 
     numred = numblue = 0;
     firstrow = -1;
     lastrow = 0;
 
     for (row=0;row<height;row++){
-        int * map;
+        unsigned char * map;
         unsigned char * img;
-        map = &WeightMap->values[width*row];
-        img = &MapPic->pixels[width*3*row];
+        map = RowWeights;
+        img = &MapPic->pixels[width*MapPic->components*row];
         for (col=0;col<width;col++){
             int r,g,b;
-            r = img[0];
-            g = img[1];
-            b = img[2];
-            img += 3;
+            r = g = b = img[0]; // A gray map just has everything at normal weight.
+            if (MapPic->components == 3){
+                g = img[1];
+                b = img[2];
+            }
+            img += MapPic->components;
 
             // If the map is blue, then ignore.
             // If the map is red, then wight 2x.
@@ -132,51 +204,78 @@ void ProcessDiffMap(MemImage_t * MapPic)
             }
             map += 1;
         }
+        AddRowSpans(WeightMap, row, RowWeights);
     }
 
-    Regions.DetectReg.y1 = firstrow;
-    Regions.DetectReg.y2 = lastrow;
+    Regions->DetectReg.y1 = firstrow;
+    Regions->DetectReg.y2 = lastrow;
 
     ShowWeightMap(WeightMap);
+    return WeightMap;
 }
 
 //----------------------------------------------------------------------------------------
-// Calculate average brightness of an image.
+// Sum up brightness of an image over a region.  Sum is of 4x brightness
+// Only looks at pixels that are in weight map spans.
 //----------------------------------------------------------------------------------------
-double AverageBright(MemImage_t * pic, Region_t Region, ImgMap_t* WeightMap)
+double SumBright(MemImage_t * pic, Region_t Region, WeightMap_t* WeightMap, int * pDetectionPixels)
 {
     double baverage;//
     int DetectionPixels;
     int row;
-    int rowbytes = pic->width*3;
+    int nc = pic->components;
+    int rowbytes = pic->width*nc;
     DetectionPixels = 0;
  
     // Compute average brightnesses.
     baverage = 0;//rzaverage = 0;
     for (row=Region.y1;row<Region.y2;row++){
-        unsigned char *p1;
-		int *px;
-        int col, brow = 0;//, redrow = 0;
-        p1 = pic->pixels+rowbytes*row;
-        px = &WeightMap->values[pic->width*row];
-        for (col=Region.x1;col<Region.x2;col++){
-            if (px[col]){
-                int bv;
-                bv = p1[0]+p1[1]*2+p1[2];  // Multiplies by 4.
-                brow += bv;
-                DetectionPixels += 1;
+        int brow = 0;//, redrow = 0;
+        for (Span_t * sp = FIRST_SPAN(WeightMap, row); sp < END_SPAN(WeightMap, row); sp++){
+            int x1 = sp->x1 > Region.x1 ? sp->x1 : Region.x1;
+            int x2 = sp->x2 < Region.x2 ? sp->x2 : Region.x2;
+            unsigned char *p1 = pic->pixels+rowbytes*row+x1*nc;
+            if (nc == 1){
+                // Luma only.
+                for (int col=x1;col<x2;col++) brow += p1[col-x1]*4;
+            }else{
+                for (int col=x1;col<x2;col++){
+                    int bv;
+                    bv = p1[0]+p1[1]*2+p1[2];  // Multiplies by 4.
+                    brow += bv;
+                    p1 += 3;
+                }
             }
-            p1 += 3;
+            if (x2 > x1) DetectionPixels += x2-x1;
         }
         baverage += brow;
     }
 
+    *pDetectionPixels = DetectionPixels;
+    return baverage;
+}
+
+//----------------------------------------------------------------------------------------
+// Turn brightness sum into average brightness.
+//----------------------------------------------------------------------------------------
+double BrightFromSum(double Sum, int DetectionPixels)
+{
     if (DetectionPixels < 1000){
         fprintf(stderr, "Detection region too small");
         exit(-1);
     }
    
-    return baverage * 0.25 / DetectionPixels; // Multiply by 4 again.
+    return Sum * 0.25 / DetectionPixels; // Multiply by 4 again.
+}
+
+//----------------------------------------------------------------------------------------
+// Calculate average brightness of an image.
+//----------------------------------------------------------------------------------------
+double AverageBright(MemImage_t * pic, Region_t Region, WeightMap_t* WeightMap)
+{
+    int DetectionPixels;
+    double Sum = SumBright(pic, Region, WeightMap, &DetectionPixels);
+    return BrightFromSum(Sum, DetectionPixels);
 }
 
 
@@ -266,9 +365,10 @@ void BloomImgMap(ImgMap_t * src, ImgMap_t * dst)
 }
 
 //----------------------------------------------------------------------------------------
-// Block filter an image.  Modifies in place.
+// Block filter an image into dst_tmp, which must be the same size.  Returns the largest
+// window sum, and where it was.
 //----------------------------------------------------------------------------------------
-int BlockFilterImgMap(const ImgMap_t * src, int fw, int fh, int * pmaxc, int * pmaxr)
+int BlockFilterImgMap(const ImgMap_t * src, ImgMap_t * dst_tmp, int fw, int fh, int * pmaxc, int * pmaxr)
 {
 	int w = src->w;
 	int h = src->h;
@@ -276,12 +376,11 @@ int BlockFilterImgMap(const ImgMap_t * src, int fw, int fh, int * pmaxc, int * p
 		fprintf(stderr, "filter too big\n");
 		return 0;
 	}
-    
-    static ImgMap_t * dst_tmp = NULL;
-    if (dst_tmp == NULL){
-        dst_tmp = MakeImgMap(src->w, src->h); // All subsequent images same size.
-    }
-    
+	if (dst_tmp->w != w || dst_tmp->h != h){
+		fprintf(stderr, "filter map size mismatch\n");
+		return 0;
+	}
+
 
 	// Sum horizontally and copy to dst_tmp
 	fw -= 1;
@@ -341,6 +440,46 @@ int BlockFilterImgMap(const ImgMap_t * src, int fw, int fh, int * pmaxc, int * p
 	return maxv;
 }
 
+//----------------------------------------------------------------------------------------
+// Find the strongest windows in a block filtered map that are apart from each other.
+// Each window found blanks out the windows within a window size of it, so one large
+// area of motion doesn't show up as several windows next to each other.  That's at most
+// MaxPeaks passes over the map.  Returns number of windows found that are at least MinVal.
+//----------------------------------------------------------------------------------------
+int BlockFilterPeaks(ImgMap_t * Filtered, int fw, int fh, int MinVal, int MaxPeaks, int * pcols, int * prows, int * pvals)
+{
+    int w = Filtered->w;
+    int h = Filtered->h;
+    int NumPeaks;
+
+    for (NumPeaks=0;NumPeaks<MaxPeaks;NumPeaks++){
+        int maxr = 0, maxc = 0, maxv = 0;
+        for (int r=0;r<h;r++){
+            int * row = &Filtered->values[r*w];
+            for (int c=0;c<w;c++){
+                if (row[c] > maxv){
+                    maxv = row[c];
+                    maxr = r;
+                    maxc = c;
+                }
+            }
+        }
+        if (maxv < MinVal || maxv <= 0) break;
+        pcols[NumPeaks] = maxc;
+        prows[NumPeaks] = maxr;
+        pvals[NumPeaks] = maxv;
+
+        // Blank out windows that overlap or touch this one.
+        for (int r=maxr-fh*2+1;r<maxr+fh*2;r++){
+            if (r < 0 || r >= h) continue;
+            for (int c=maxc-fw*2+1;c<maxc+fw*2;c++){
+                if (c >= 0 && c < w) Filtered->values[r*w+c] = 0;
+            }
+        }
+    }
+    return NumPeaks;
+}
+
 
 
 /*
@@ -362,7 +501,7 @@ int main()
 	printf("Bloomed map:\n");
 	ShowImgMap(TestD,1);
 
-	BlockFilterImgMap(TestD, 3,4, NULL, NULL, NULL);
+	BlockFilterImgMap(Test, TestD, 3,4, NULL, NULL);
 	printf("Block filtered map:\n");
 	ShowImgMap(TestD,1);
 	
@@ -19,6 +19,10 @@ char DoDirName[200];
 char SaveDir[200];
 char SaveNames[200];
 char CopyJpgCmd[200];
+char CopyJpgCoproc[200];
+int CoprocWindow = 4;
+int SaveMethod = SAVE_COPY;
+int OptimizeJpg = 0;
 
 int FollowDir = 0;
 int ScaleDenom;
@@ -32,6 +36,18 @@ int MotionFatigueTc = 30;
 int FatigueSkipCount = 0;
 int FatigueGainPercent = 100;
 
+int NumThreads = 1;
+int FusedCompare = 0;
+int PyramidPercent = 0;
+int DctPercent = 0;
+int DecodeColors = DECODE_RGB;
+int MaxBacklog = 0;
+int MaxLag = 0;
+int PipelineThreads = 0;
+int SaveQueueDepth = 0;
+int SaveDrop = 0;
+int DirEvents = 1;
+
 char DiffMapFileName[200];
 Regions_t Regions;
 
@@ -51,6 +67,11 @@ int lightoff_min = 10;
 int lightoff_max = 60;
 char UdpDest[30];
 
+// Camera sections.  Settings before the first section are the defaults for all of them.
+CamConfig_t CamConfigs[MAX_CAMERAS];
+int NumCamConfigs = 0;
+static CamConfig_t CamDefaults;
+
 //-----------------------------------------
 // Video mode hack specific configuration
 int VidMode; // Video mode flag
@@ -78,6 +99,13 @@ void usage (void)// complain about bad command line
      " -copyjpgcmd <cmd>     Optional command to apply when copying jpeg image\n"
      "                       to keep.  &i and &o will be in and out file names.\n"
      "                       Useful to run jpegtran to make images files smaller\n"
+     " -copyjpgcoproc <cmd>  Converter to start once and send saved images to, as\n"
+     "                       lines of input<tab>output.  Answers a line per image\n"
+     " -coprocwindow <n>     Images sent to it before waiting for answers\n"
+     " -optimizejpg <n>      Losslessly make saved images smaller, without running\n"
+     "                       jpegtran.  1 = optimize, 2 = also progressive\n"
+     " -savemethod <method>  move, sendfile or copy.  How to save images, and\n"
+     "                       rotate the log.  Default copy\n"
      " -premotion <n>        0 or 1.  Keep up to 1 image before motion\n"
      " -postmotion <n>       Keep n frames after motion was detected\n"
      " -tempdir <dir>        Where to put temp images for video mode hack\n"
@@ -115,6 +143,26 @@ void usage (void)// complain about bad command line
      " -fatigue_tc           Motion fatigue time constant, 0=no motion fatigue\n"
      " -fatigue_percent <n>  Gain factor (default 100) for motion fatigue strength\n"
      " -fatigue_skip <n>     Skip applying motion fatigue every n frames\n"
+     " -threads <n>          Number of threads to use for comparing images\n"
+     " -fused <n>            1 = compare to previous image while decoding\n"
+     " -pyramid <n>          Compare at full resolution only when a coarse compare\n"
+     "                       finds at least n percent of sensitivity.  0 = off\n"
+     " -dctfilter <n>        Decode only images whose jpeg block averages show at\n"
+     "                       least n percent of sensitivity.  0 = off\n"
+     " -luma <n>             1 = decode and compare brightness only, no color\n"
+     " -ycc <n>              1 = compare in the jpeg's own YCbCr, chroma at half size\n"
+     " -maxbacklog <n>       With followdir, shed load when more than n frames\n"
+     "                       are waiting to be processed.  0 = off\n"
+     " -maxlag <n>           With followdir, shed load when the oldest waiting\n"
+     "                       frame is more than n seconds old.  0 = off\n"
+     " -pipeline <n>         Decode frames ahead of comparing on n threads, and\n"
+     "                       save frames on another thread.  0 = off\n"
+     " -direvents <0|1>      With followdir, take new frames from inotify events\n"
+     "                       instead of scanning the directory.  Default 1\n"
+     " -savequeue <n>        Save frames on another thread, with up to n waiting.\n"
+     "                       0 = only with pipeline\n"
+     " -savedrop <0|1>       With followdir, drop frames when the save queue is\n"
+     "                       full instead of waiting.  Default 0\n"
      " -verbose or -debug    Emit more verbose output\n"
      " -logtofile            Log to file instead of stdout\n"
      " -movelognames <schme> Rotate log files, scheme works just like\n"
@@ -226,6 +274,46 @@ static int parse_parameter (const char * tag, const char * value)
         if (sscanf(value, "%d", &FatigueGainPercent) != 1) return -1;
     }else if (keymatch(tag, "fatigue_skip", 10)) {
         if (sscanf(value, "%d", &FatigueSkipCount) != 1) return -1;
+    } else if (keymatch(tag, "threads", 7)) {
+        if (sscanf(value, "%d", &NumThreads) != 1) return -1;
+        if (NumThreads < 1 || NumThreads > MAX_THREADS){
+            fprintf(stderr, "threads must be in range 1-%d\n", MAX_THREADS);
+            return -1;
+        }
+    } else if (keymatch(tag, "fused", 5)) {
+        if (sscanf(value, "%d", &FusedCompare) != 1) return -1;
+    } else if (keymatch(tag, "pyramid", 7)) {
+        if (sscanf(value, "%d", &PyramidPercent) != 1) return -1;
+    } else if (keymatch(tag, "dctfilter", 9)) {
+        if (sscanf(value, "%d", &DctPercent) != 1) return -1;
+    } else if (keymatch(tag, "luma", 4)) {
+        int a;
+        if (sscanf(value, "%d", &a) != 1) return -1;
+        DecodeColors = a ? DECODE_LUMA : DECODE_RGB;
+    } else if (keymatch(tag, "ycc", 3)) {
+        int a;
+        if (sscanf(value, "%d", &a) != 1) return -1;
+        DecodeColors = a ? DECODE_YCC : DECODE_RGB;
+    } else if (keymatch(tag, "maxbacklog", 10)) {
+        if (sscanf(value, "%d", &MaxBacklog) != 1) return -1;
+    } else if (keymatch(tag, "maxlag", 6)) {
+        if (sscanf(value, "%d", &MaxLag) != 1) return -1;
+    } else if (keymatch(tag, "pipeline", 8)) {
+        if (sscanf(value, "%d", &PipelineThreads) != 1) return -1;
+        if (PipelineThreads < 0 || PipelineThreads > MAX_THREADS){
+            fprintf(stderr, "pipeline must be in range 0-%d\n", MAX_THREADS);
+            return -1;
+        }
+    } else if (keymatch(tag, "direvents", 9)) {
+        if (sscanf(value, "%d", &DirEvents) != 1) return -1;
+    } else if (keymatch(tag, "savequeue", 9)) {
+        if (sscanf(value, "%d", &SaveQueueDepth) != 1) return -1;
+        if (SaveQueueDepth < 0 || SaveQueueDepth > MAX_SAVE_QUEUE){
+            fprintf(stderr, "savequeue must be in range 0-%d\n", MAX_SAVE_QUEUE);
+            return -1;
+        }
+    } else if (keymatch(tag, "savedrop", 8)) {
+        if (sscanf(value, "%d", &SaveDrop) != 1) return -1;
     } else if (keymatch(tag, "scale", 5)) {
         // Scale the output image by a fraction 1/N.
         if (sscanf(value, "%d", &ScaleDenom) != 1) return -1;
@@ -301,6 +389,32 @@ static int parse_parameter (const char * tag, const char * value)
         // to make them losselssly 5% smaller with jpegtran, provided your on raspberry pi2 or faster.
         strncpy(CopyJpgCmd, value, sizeof(CopyJpgCmd)-1);
 
+    } else if (keymatch(tag, "copyjpgcoproc", 13)) {
+        strncpy(CopyJpgCoproc, value, sizeof(CopyJpgCoproc)-1);
+    } else if (keymatch(tag, "coprocwindow", 12)) {
+        if (sscanf(value, "%d", &CoprocWindow) != 1) return -1;
+        if (CoprocWindow < 1 || CoprocWindow > MAX_COPROC_WINDOW){
+            fprintf(stderr, "coprocwindow must be in range 1-%d\n", MAX_COPROC_WINDOW);
+            return -1;
+        }
+    } else if (keymatch(tag, "optimizejpg", 11)) {
+        if (sscanf(value, "%d", &OptimizeJpg) != 1) return -1;
+        if (OptimizeJpg < 0 || OptimizeJpg > 2){
+            fprintf(stderr, "optimizejpg must be 0, 1 or 2\n");
+            return -1;
+        }
+    } else if (keymatch(tag, "savemethod", 10)) {
+        if (strcmp(value, "move") == 0){
+            SaveMethod = SAVE_MOVE;
+        }else if (strcmp(value, "sendfile") == 0){
+            SaveMethod = SAVE_SENDFILE;
+        }else if (strcmp(value, "copy") == 0){
+            SaveMethod = SAVE_COPY;
+        }else{
+            fprintf(stderr, "savemethod must be move, sendfile or copy\n");
+            return -1;
+        }
+
     } else if (keymatch(tag, "logtofile", 8)) {
         // Log to a file instead of stdout.  Must log to /ramdisk/log.txt for realtime view to work.
         strncpy(LogToFile, value, sizeof(SaveDir)-1);
@@ -310,15 +424,11 @@ static int parse_parameter (const char * tag, const char * value)
     } else if (keymatch(tag, "region", 3)) {
         if (!ParseRegion(&Regions.DetectReg, value)) goto bad_value;
     } else if (keymatch(tag, "exclude", 4)) {
-        if (Regions.NumExcludeReg >= MAX_EXCLUDE_REGIONS){
-            fprintf(stderr, "too many exclude regions");
-            exit(-1);
-        }else{
-            Region_t NewEx;
-            if (!ParseRegion(&NewEx, value)) goto bad_value;
-            printf("Exclude region x:%d-%d, y:%d-%d\n",NewEx.x1, NewEx.x2, NewEx.y1, NewEx.y2);
-            Regions.ExcludeReg[Regions.NumExcludeReg++] = NewEx;
-        }
+        Region_t NewEx;
+        if (!ParseRegion(&NewEx, value)) goto bad_value;
+        printf("Exclude region x:%d-%d, y:%d-%d\n",NewEx.x1, NewEx.x2, NewEx.y1, NewEx.y2);
+        Regions.ExcludeReg = realloc(Regions.ExcludeReg, sizeof(Region_t)*(Regions.NumExcludeReg+1));
+        Regions.ExcludeReg[Regions.NumExcludeReg++] = NewEx;
     } else if (keymatch(tag, "diffmap", 5)) {
         strncpy(DiffMapFileName,value, sizeof(DiffMapFileName)-1);
 
@@ -374,6 +484,68 @@ int parse_switches (int argc, char **argv, int last_file_arg_seen)
     return argc;
 }
 
+//-----------------------------------------------------------------------------------
+// Copy the current camera specific settings into Conf.
+//-----------------------------------------------------------------------------------
+void GetCamConfig(CamConfig_t * Conf)
+{
+    strcpy(Conf->DoDirName, DoDirName);
+    Conf->FollowDir = FollowDir;
+    strcpy(Conf->SaveDir, SaveDir);
+    strcpy(Conf->DiffMapFileName, DiffMapFileName);
+    strcpy(Conf->camera_prog_cmd, camera_prog_cmd);
+    Conf->Regions = Regions;
+    Conf->Sensitivity = Sensitivity;
+}
+
+//-----------------------------------------------------------------------------------
+// Make the settings of a camera the current ones.
+//-----------------------------------------------------------------------------------
+void SetCamConfig(const CamConfig_t * Conf)
+{
+    strcpy(DoDirName, Conf->DoDirName);
+    FollowDir = Conf->FollowDir;
+    strcpy(SaveDir, Conf->SaveDir);
+    strcpy(DiffMapFileName, Conf->DiffMapFileName);
+    strcpy(camera_prog_cmd, Conf->camera_prog_cmd);
+    Regions = Conf->Regions;
+    Sensitivity = Conf->Sensitivity;
+}
+
+//-----------------------------------------------------------------------------------
+// Handle a "[name]" line starting a camera section.  The previous section's settings
+// are stored away, and the new section starts out with the defaults.
+//-----------------------------------------------------------------------------------
+static int StartCameraSection(const char * Line)
+{
+    int len = strlen(Line);
+    if (len < 3 || Line[len-1] != ']' || len-2 >= sizeof(CamDefaults.Name)){
+        fprintf(stderr, "Bad camera section '%s'\n", Line);
+        return 0;
+    }
+
+    if (NumCamConfigs == 0){
+        // Settings so far apply to all cameras.
+        GetCamConfig(&CamDefaults);
+    }else{
+        GetCamConfig(&CamConfigs[NumCamConfigs-1]);
+    }
+    if (NumCamConfigs >= MAX_CAMERAS){
+        fprintf(stderr, "Too many cameras, at most %d\n", MAX_CAMERAS);
+        return 0;
+    }
+
+    CamConfig_t * Conf = &CamConfigs[NumCamConfigs++];
+    memset(Conf, 0, sizeof(CamConfig_t));
+    memcpy(Conf->Name, Line+1, len-2);
+
+    // Exclude regions get added to, so each camera needs its own copy.
+    SetCamConfig(&CamDefaults);
+    Regions.ExcludeReg = malloc(sizeof(Region_t)*(Regions.NumExcludeReg+1));
+    memcpy(Regions.ExcludeReg, CamDefaults.Regions.ExcludeReg, sizeof(Region_t)*Regions.NumExcludeReg);
+    return 1;
+}
+
 //-----------------------------------------------------------------------------------
 // Too many parameters for imgcomp running.  Just read them from a configuration file.
 //-----------------------------------------------------------------------------------
@@ -413,6 +585,12 @@ void read_config_file(char *config_file)
         if (*s == '#') continue; // comment.
         if (*s == '\r' || *s == '\n') continue; // Blank line.
 
+        if (*s == '['){
+            if (!StartCameraSection(s)) goto no_good;
+            printf("Camera '%s':\n", CamConfigs[NumCamConfigs-1].Name);
+            continue;
+        }
+
         value = strstr(s, "=");
         if (value != NULL){
             t = value;
@@ -447,4 +625,11 @@ no_good:
         }
 
     }
+    fclose(file);
+
+    if (NumCamConfigs){
+        // Store last camera section, and go back to the defaults for command line options.
+        GetCamConfig(&CamConfigs[NumCamConfigs-1]);
+        SetCamConfig(&CamDefaults);
+    }
 }
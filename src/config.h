@@ -12,6 +12,17 @@ extern int ExposureManagementOn;
 extern int MotionFatigueTc;
 extern int FatigueGainPercent;
 extern int FatigueSkipCount;
+extern int NumThreads;
+extern int FusedCompare;
+extern int PyramidPercent;
+extern int DctPercent;
+extern int DecodeColors;
+extern int MaxBacklog;
+extern int MaxLag;
+extern int PipelineThreads;
+extern int SaveQueueDepth;
+extern int SaveDrop;
+extern int DirEvents;
 
 extern char DiffMapFileName[200];
 extern Regions_t Regions;
@@ -29,6 +40,24 @@ extern char UdpDest[30];
 extern int relaunch_timeout;
 extern int give_up_timeout;
 
+// Settings that each camera section of the configuration file has its own of.
+typedef struct {
+    char Name[30];
+    char DoDirName[200];
+    int FollowDir;
+    char SaveDir[200];
+    char DiffMapFileName[200];
+    char camera_prog_cmd[200];
+    Regions_t Regions;
+    int Sensitivity;
+}CamConfig_t;
+
+#define MAX_CAMERAS 8
+extern CamConfig_t CamConfigs[MAX_CAMERAS];
+extern int NumCamConfigs;
+void GetCamConfig(CamConfig_t * Conf);
+void SetCamConfig(const CamConfig_t * Conf);
+
 void usage (void);// complain about bad command line 
 void read_config_file(char *name);
 int parse_switches (int argc, char **argv, int last_file_arg_seen);
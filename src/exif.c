@@ -865,6 +865,94 @@ void process_EXIF (unsigned char * ExifSection, unsigned int length)
     ProcessExifDir(ExifSection+8+FirstOffset, ExifSection+8, length-8, 0);
 }
 
+//--------------------------------------------------------------------------
+// Pick just the tags exposure management needs out of one exif directory.
+// Nothing gets printed or allocated, tags not needed are just skipped.
+//--------------------------------------------------------------------------
+static void ScanExposureDir(unsigned char * DirStart, unsigned char * OffsetBase,
+        unsigned ExifLength, int NestingLevel)
+{
+    int de;
+    int NumDirEntries;
+
+    if (DirStart+2 > OffsetBase+ExifLength) return;
+    NumDirEntries = Get16u(DirStart);
+    if (DIR_ENTRY_ADDR(DirStart, NumDirEntries) > OffsetBase+ExifLength) return;
+
+    for (de=0;de<NumDirEntries;de++){
+        int Tag, Format;
+        unsigned Components, ByteCount;
+        unsigned char * ValuePtr;
+        unsigned char * DirEntry;
+        DirEntry = DIR_ENTRY_ADDR(DirStart, de);
+
+        Tag = Get16u(DirEntry);
+        if (Tag != TAG_MODEL && Tag != TAG_EXPOSURETIME && Tag != TAG_ISO_EQUIVALENT
+                && Tag != TAG_EXPOSURE_INDEX && Tag != TAG_EXIF_OFFSET) continue;
+
+        Format = Get16u(DirEntry+2);
+        Components = Get32u(DirEntry+4);
+        if ((unsigned)(Format-1) >= NUM_FORMATS || Components > 0x10000) continue;
+
+        ByteCount = Components * BytesPerFormat[Format];
+        if (ByteCount > 4){
+            unsigned OffsetVal = Get32u(DirEntry+8);
+            if (OffsetVal > ExifLength || ByteCount > ExifLength-OffsetVal) continue;
+            ValuePtr = OffsetBase+OffsetVal;
+        }else{
+            ValuePtr = DirEntry+8;
+        }
+
+        switch(Tag){
+            case TAG_MODEL:
+                strncpy(ImageInfo.CameraModel, (char *)ValuePtr, ByteCount < 39 ? ByteCount : 39);
+                break;
+
+            case TAG_EXPOSURETIME:
+                ImageInfo.ExposureTime = (float)ConvertAnyFormat(ValuePtr, Format);
+                break;
+
+            case TAG_EXPOSURE_INDEX:
+                if (ImageInfo.ISOequivalent) break;
+                // Fallthru...
+            case TAG_ISO_EQUIVALENT:
+                ImageInfo.ISOequivalent = (int)ConvertAnyFormat(ValuePtr, Format);
+                break;
+
+            case TAG_EXIF_OFFSET:
+                if (NestingLevel == 0 && Get32u(ValuePtr) < ExifLength){
+                    ScanExposureDir(OffsetBase + Get32u(ValuePtr), OffsetBase, ExifLength, 1);
+                }
+                break;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------
+// Cut down process_EXIF for exposure management, which looks at every frame
+// but only needs camera model, exposure time and ISO.
+//--------------------------------------------------------------------------
+void process_EXIF_exposure(unsigned char * ExifSection, unsigned int length)
+{
+    unsigned int FirstOffset;
+
+    if (length < 16 || memcmp(ExifSection+2, "Exif\0\0", 6)) return;
+
+    if (memcmp(ExifSection+8,"II",2) == 0){
+        MotorolaOrder = 0;
+    }else if (memcmp(ExifSection+8,"MM",2) == 0){
+        MotorolaOrder = 1;
+    }else{
+        return;
+    }
+    if (Get16u(ExifSection+10) != 0x2a) return;
+
+    FirstOffset = Get32u(ExifSection+12);
+    if (FirstOffset < 8 || FirstOffset > length-16) return;
+
+    ScanExposureDir(ExifSection+8+FirstOffset, ExifSection+8, length-8, 0);
+}
+
 
 
 
@@ -89,31 +89,36 @@ char * GetRaspistillExpParms()
 //----------------------------------------------------------------------------------------
  // Calculate desired exposure adjustment with respect to given image.
 //----------------------------------------------------------------------------------------
-int CalcExposureAdjust(MemImage_t * pic)
+int CalcExposureAdjust(MemImage_t * pic, CompareContext_t * Ctx)
 {
-    Region_t Region = Regions.DetectReg;
+    WeightMap_t * WeightMap = Ctx->WeightMap;
+    Region_t Region = Ctx->Regions.DetectReg;
     if (Region.y2 > pic->height) Region.y2 = pic->height;
     if (Region.x2 > pic->width) Region.x2 = pic->width;
 
     int BrHistogram[256] = {0}; // Brightness histogram, for red green and blue channels.
     int NumPix = 0;
-    int width = pic->width;
-
-    int rowbytes = pic->width*3;
-    for (int row=Region.y1;row<Region.y2;row++){
-        unsigned char *p1;
-        p1 = pic->pixels+rowbytes*row;
-        int * ExRow = NULL;
-        if (WeightMap) ExRow = &WeightMap->values[width*row];
-        for (int col=Region.x1;col<Region.x2;col++){
-            if (ExRow && ExRow[col]){
-                // Apply the colors to the histogram separately (saturating one is saturated enough)
-                BrHistogram[p1[0]] += 2; // Red,   1/3 weight
-                BrHistogram[p1[1]] += 3; // Green, 1/2 weight
-                BrHistogram[p1[2]] += 1; // Blue,  1/6 weight
+
+    int nc = pic->components;
+    int rowbytes = pic->width*nc;
+    for (int row=Region.y1;row<Region.y2 && WeightMap;row++){
+        for (Span_t * sp = FIRST_SPAN(WeightMap, row); sp < END_SPAN(WeightMap, row); sp++){
+            int x1 = sp->x1 > Region.x1 ? sp->x1 : Region.x1;
+            int x2 = sp->x2 < Region.x2 ? sp->x2 : Region.x2;
+            unsigned char *p1;
+            p1 = pic->pixels+rowbytes*row+x1*nc;
+            for (int col=x1;col<x2;col++){
+                if (nc == 1){
+                    BrHistogram[p1[0]] += 6; // Luma only, weight of all three colors
+                }else{
+                    // Apply the colors to the histogram separately (saturating one is saturated enough)
+                    BrHistogram[p1[0]] += 2; // Red,   1/3 weight
+                    BrHistogram[p1[1]] += 3; // Green, 1/2 weight
+                    BrHistogram[p1[2]] += 1; // Blue,  1/6 weight
+                }
                 NumPix += 1;
+                p1 += nc;
             }
-            p1 += 3;
         }
     }
     NumPix *= 6;
@@ -9,18 +9,35 @@ typedef struct {
     int width;
     int height;
     int components;
+    int Ycc;        // Luma (components = 1) followed by Cb and Cr planes at half size
+    int BufSize;    // Room for pixels, for reusing the buffer
     unsigned char pixels[1];
 }MemImage_t;
 
+// A jpeg file read into memory, so that it only gets read from disk once.  Exif parsing,
+// decoding (as often as needed) and saving a copy all work from this.
+typedef struct {
+    char Name[500];
+    time_t MTime;
+    int Size;
+    int BufSize;    // Room for data, for reusing the buffer
+    unsigned char Data[0];
+}FileData_t;
+
+// Chroma planes of a Ycc image, half the width and height of the luma.
+#define CHROMA_W(img) (((img)->width+1)/2)
+#define CHROMA_H(img) (((img)->height+1)/2)
+#define CB_PLANE(img) ((img)->pixels+(img)->width*(img)->height)
+#define CR_PLANE(img) (CB_PLANE(img)+CHROMA_W(img)*CHROMA_H(img))
+
 typedef struct {
     int x1, x2;
     int y1, y2;
 }Region_t;
 
-#define MAX_EXCLUDE_REGIONS 5
 typedef struct {
     Region_t DetectReg;
-    Region_t ExcludeReg[MAX_EXCLUDE_REGIONS];
+    Region_t * ExcludeReg;
     int NumExcludeReg;
 }Regions_t;
 
@@ -28,13 +45,109 @@ typedef struct {
     int DiffLevel;
     int x, y;
 	int Motion;
+    int x1, y1, x2, y2; // Window the motion was found in
 }TriggerInfo_t;
 
+// Separate areas of motion, strongest first.  The first one is always
+// filled in (with DiffLevel 0 if there was no motion), the others only
+// if they are at least Sensitivity.
+#define MAX_MOTION_OBJECTS 4
+typedef struct {
+    int NumObjects;
+    TriggerInfo_t Objects[MAX_MOTION_OBJECTS];
+}TriggerList_t;
+
 typedef struct {
     int w, h;
     int values[0];
 }ImgMap_t;
 
+// Weight map is stored as runs of included pixels for each row.
+typedef struct {
+    int x1, x2;     // Columns x1 to x2-1
+    int weight;     // 1 = normal, 2 = double weight
+}Span_t;
+
+typedef struct {
+    int w, h;
+    int * RowSpans; // Spans of row r are Spans[RowSpans[r]] up to Spans[RowSpans[r+1]]
+    Span_t * Spans;
+    int NumSpans;
+    int SpansAllocated;
+}WeightMap_t;
+
+#define FIRST_SPAN(map, row) (&(map)->Spans[(map)->RowSpans[row]])
+#define END_SPAN(map, row) (&(map)->Spans[(map)->RowSpans[(row)+1]])
+
+// Per pixel differences.  These are capped at 255, so one byte each is enough.
+typedef struct {
+    int w, h;
+    unsigned char values[0];
+}DiffMap_t;
+
+// What a map of scaled down differences was made from, for rechecking around motion.
+typedef struct {
+    const MemImage_t * pic1, * pic2; // NULL if not from a full resolution compare
+    int Threshold;
+    int Hist[256];  // Histogram of the whole detection region
+}ScaledFrom_t;
+
+// Everything one motion detector works with.  Settings are copied from the
+// configuration when it's made.  Working maps get allocated on first use, and
+// reallocated if the picture size changes.
+typedef struct {
+    // Settings
+    Regions_t Regions;      // Scaled to picture size.
+    int ScaleDenom;
+    Regions_t BaseRegions;  // As scaled when made, for changing the scale later.
+    int BaseScaleDenom;
+    int Sensitivity;
+    int MotionFatigueTc;
+    int FatigueGainPercent;
+    int PyramidPercent;
+    int DctPercent;
+
+    int NewestAverageBright;
+
+    // Working maps
+    WeightMap_t * WeightMap;
+    int WeightMapFromFile;  // Loaded from a diff map, can't be made for another size.
+    DiffMap_t * DiffVal;
+    int * YccRows;          // Chroma differences for each band's row, with Ycc pictures
+    int widthSc, heightSc;  // Scaled down differences and motion fatigue
+    ImgMap_t * DiffScaled;
+    ImgMap_t * PrevScaled;  // DiffScaled of the compare before
+    ScaledFrom_t DiffFrom, PrevFrom; // What those were made from
+    ImgMap_t * Fatigue;
+    ImgMap_t * FatigueBl;
+    ImgMap_t * Fatigued;    // DiffScaled with motion fatigue taken off
+    ImgMap_t * LocalScaled; // For rechecking around previous motion
+    ImgMap_t * CellWeight;  // Sum of pixel weights in each cell
+    ImgMap_t * Filtered;    // Block filtered scaled differences
+    int SinceFatiguePrint;
+
+    const TriggerInfo_t * RecheckAround; // Set while RecheckPix is running.
+    struct CompareJob_s * Job;
+    struct FusedCompare_s * Fused;
+}CompareContext_t;
+
+// Things about a frame that stay the same for every comparison it's in.
+typedef struct {
+    int HaveBright;
+    double Bright;      // Average brightness over the detection region
+    MemImage_t * Coarse;// Block averaged copy for pyramid mode
+    int Width, Height;  // Picture size, for a Coarse made from the jpeg's DC coefficients
+}FrameFeatures_t;
+
+// Part of a picture to decode.  Worked out from the compare context before the picture
+// is handed to a decode thread, as only the compare stage may look at the context.
+typedef struct {
+    int ScaleDenom;
+    int HaveBox;
+    Region_t Box;
+    int Width, Height;  // Picture size the box was worked out for.
+}DecodeBox_t;
+
 typedef struct {
     int ISOmin, ISOmax; // Limits of ISO values to pass to raspistill
     float Tmin, Tmax;   // Limits of exposure time (in seconds) to pass to raspistill
@@ -48,7 +161,6 @@ extern exconfig_t ex;
 
 
 extern MemImage_t MemImage;
-extern int NewestAverageBright;
 extern int MsPerCycle; // HOw often to check for new images.
 extern int Verbosity;
 extern char LogToFile[200];
@@ -61,9 +173,16 @@ extern int BrightnessChangeRestart;
 extern char SaveDir[200];
 extern char SaveNames[200];
 extern char CopyJpgCmd[200];
+extern char CopyJpgCoproc[200];
+extern int CoprocWindow;
+#define MAX_COPROC_WINDOW 32
+extern int SaveMethod;
+#define SAVE_MOVE     0   // Rename frames that get deleted anyway, copy others with sendfile
+#define SAVE_SENDFILE 1   // Copy with sendfile, in the kernel
+#define SAVE_COPY     2   // Copy by reading and writing
+extern int OptimizeJpg;  // 1 = optimize huffman tables of saved jpegs, 2 = also make them progressive
 
 extern Regions_t Regions;
-extern ImgMap_t * WeightMap;
 
 extern time_t LastPic_mtime;
 
@@ -73,30 +192,112 @@ extern char VidDecomposeCmd[200];
 
 // exposure.c functions
 char * GetRaspistillExpParms();
-int CalcExposureAdjust(MemImage_t * pic);
+int CalcExposureAdjust(MemImage_t * pic, CompareContext_t * Ctx);
 
 
 // compare_util.c functions
-void FillWeightMap(int width, int height);
-void ProcessDiffMap(MemImage_t * MapPic);
-double AverageBright(MemImage_t * pic, Region_t Region, ImgMap_t* WeightMap);
+WeightMap_t * FillWeightMap(int width, int height, Regions_t * Regions);
+WeightMap_t * ProcessDiffMap(MemImage_t * MapPic, Regions_t * Regions);
+void FreeWeightMap(WeightMap_t * Map);
+double SumBright(MemImage_t * pic, Region_t Region, WeightMap_t* WeightMap, int * pDetectionPixels);
+double BrightFromSum(double Sum, int DetectionPixels);
+double AverageBright(MemImage_t * pic, Region_t Region, WeightMap_t* WeightMap);
 
 ImgMap_t * MakeImgMap(int w,int h);
 void ShowImgMap(ImgMap_t * map, int divisor);
 void BloomImgMap(ImgMap_t * src, ImgMap_t * dst);
-int BlockFilterImgMap(const ImgMap_t * src, int fw, int fh, int * pmaxc, int * pmaxr);
+int BlockFilterImgMap(const ImgMap_t * src, ImgMap_t * dst, int fw, int fh, int * pmaxc, int * pmaxr);
+int BlockFilterPeaks(ImgMap_t * Filtered, int fw, int fh, int MinVal, int MaxPeaks, int * pcols, int * prows, int * pvals);
 
 // compare.c function
-TriggerInfo_t ComparePix(MemImage_t * pic1, MemImage_t * pic2, int UpdateFatigue, int SkipFatigue, char * DebugImgName, TriggerInfo_t * no_fatigue_motion);
+CompareContext_t * NewCompareContext(void);
+void FreeCompareContext(CompareContext_t * Ctx);
+int SetCompareScale(CompareContext_t * Ctx, int ScaleDenom);
+TriggerInfo_t ComparePix(CompareContext_t * Ctx, MemImage_t * pic1, MemImage_t * pic2, FrameFeatures_t * feat1, FrameFeatures_t * feat2,
+        int UpdateFatigue, int SkipFatigue, char * DebugImgName, TriggerList_t * no_fatigue_motion);
+void FreeFrameFeatures(FrameFeatures_t * feat);
+TriggerInfo_t RecheckPix(CompareContext_t * Ctx, MemImage_t * pic1, MemImage_t * pic2, FrameFeatures_t * feat1, FrameFeatures_t * feat2,
+        TriggerInfo_t Around);
+MemImage_t * LoadJPEGCompare(CompareContext_t * Ctx, FileData_t * File, int scale_denom, int ParseExif, MemImage_t * PrevPic, FrameFeatures_t * PrevFeat);
+MemImage_t * LoadJPEGDetect(CompareContext_t * Ctx, FileData_t * File, int scale_denom, int ParseExif);
+void PlanDecode(CompareContext_t * Ctx, int scale_denom, DecodeBox_t * Plan);
+MemImage_t * LoadJPEGBox(FileData_t * File, const DecodeBox_t * Plan, int ParseExif);
+int LoadDcFeatures(FileData_t * File, int scale_denom, int ParseExif, FrameFeatures_t * feat);
+int DcPrefilter(CompareContext_t * Ctx, FrameFeatures_t * feat1, FrameFeatures_t * feat2,
+        TriggerList_t * no_fatigue_motion, TriggerInfo_t * Result);
+void DiffRowScalar(const unsigned char * p1, const unsigned char * p2,
+        int n, int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd);
+void DiffRowGray(const unsigned char * p1, const unsigned char * p2,
+        int n, int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd);
+
+// compare_simd.c functions
+typedef void (*DiffRowFunc_t)(const unsigned char * p1, const unsigned char * p2,
+        int n, int m1i, int m2i, unsigned char * diffrow, int * DiffHist, unsigned char * pd);
+extern DiffRowFunc_t DiffRowKernel;
+void SelectDiffKernel(void);
 
+// workers.c functions
+#define MAX_THREADS 8
+typedef void (*BandFunc_t)(void * Arg, int Band, int NumBands);
+extern int NumBands;
+void StartWorkers(int NumThreads);
+void RunBands(BandFunc_t Func, void * Arg);
+Region_t BandRegion(Region_t Reg, int Band, int NumBands);
+
+// pipeline.c functions
+#include <semaphore.h>
+// Queue for handing items from one thread to another.
+typedef struct {
+    char * Slots;
+    int NumSlots;
+    int ItemSize;
+    unsigned Head;      // Items put in so far.  Only changed by the producing thread.
+    unsigned Tail;      // Items taken out so far.  Only changed by the consuming thread.
+    sem_t Filled, Free;
+}Queue_t;
+typedef void (*StageFunc_t)(void * Item);
+void QueueInit(Queue_t * Q, int NumSlots, int ItemSize);
+void * QueueSlot(Queue_t * Q);
+void * QueueTrySlot(Queue_t * Q);
+void QueuePush(Queue_t * Q);
+void * QueueFront(Queue_t * Q);
+void QueuePop(Queue_t * Q);
+int QueueMore(Queue_t * Q);
+int QueueCount(Queue_t * Q);
+void * QueueItem(Queue_t * Q, int n);
+void QueueWaitEmpty(Queue_t * Q);
+void StartStage(StageFunc_t Func, Queue_t * In, Queue_t * Out);
 
 // jpeg2mem.c functions
-MemImage_t * LoadJPEG(char* FileName, int scale_denom, int discard_colors, int ParseExif);
+// How LoadJPEG delivers the colors.
+#define DECODE_RGB  0
+#define DECODE_LUMA 1   // Brightness only
+#define DECODE_YCC  2   // Y, Cb and Cr planes as stored in 4:2:0 jpegs.  Others get RGB.
+MemImage_t * NewMemImage(int width, int height, int components, int Ycc);
+void FreeMemImage(MemImage_t * Image);
+extern int FrameAllocs; // Heap allocations and frees for frames.  Should stop going up once running.
+#define COUNT_FRAME_ALLOC() __atomic_add_fetch(&FrameAllocs, 1, __ATOMIC_RELAXED)
+MemImage_t * LoadJPEG(char* FileName, int scale_denom, int DecodeColors, int ParseExif);
+typedef void (*RowFunc_t)(MemImage_t * Image, int FirstRow, int NumRows, void * Arg);
+MemImage_t * LoadJPEGRows(FileData_t * File, int scale_denom, int DecodeColors, int ParseExif,
+        RowFunc_t RowFunc, void * RowArg, const Region_t * Crop);
+MemImage_t * LoadJPEGDc(FileData_t * File, int scale_denom, int ParseExif, int * pWidth, int * pHeight);
+int WriteOptimizedJpeg(FileData_t * File, char * DstName, int Progressive);
 void WritePpmFile(char * FileName, MemImage_t *MemImage);
 
 // start_camera_prog functions
-int relaunch_camera_prog(void);
-int manage_camera_prog(int HaveNewImages);
+// State of the capture program of one camera.
+typedef struct {
+    int pid;
+    char OutNameSeq;
+    int MsSinceImage;
+    int MsSinceLaunch;
+    int InitialBrSum;
+    int InitialNumBr;
+    int NumTotalImages;
+}CameraProg_t;
+int relaunch_camera_prog(CameraProg_t * Prog);
+int manage_camera_prog(CameraProg_t * Prog, int HaveNewImages);
 void DoMotionRun(int SawMotion);
 extern char camera_prog_cmd[200];
 extern char lighton_run[200];
@@ -117,7 +318,15 @@ typedef struct {
 
 DirEntry_t * GetSortedDir(char * Directory, int * NumFiles);
 void FreeDir(DirEntry_t * FileNames, int NumEntries);
-char * BackupImageFile(char * Name, int DiffMag, int DoNotCopy);
+char * BackupImageFile(char * Name, FileData_t * File, int DiffMag, int DoNotCopy);
+#define MAX_SAVE_QUEUE 256
+void StartSaveThread(int Depth, int Drop);
+void SaveFrame(char * Name, FileData_t * File, int DiffMag, int DeleteSrc);
+int SavePending(const char * Name);
+void FlushSaves(void);
+void LogSaveStats(void);
+FileData_t * ReadFileData(char * FileName);
+void FreeFileData(FileData_t * File);
 void LogFileMaintain(int ForceLotSave);
 
 
@@ -108,6 +108,8 @@ typedef struct {
 
 // prototypes for jhead.c functions
 int ReadExifPart(FILE * infile);
+int ReadExifMem(const uchar * Data, int Size);
+int ReadExposureExif(const uchar * Data, int Size);
 void ErrFatal(const char * msg);
 void ErrNonfatal(const char * msg, int a1, int a2);
 
@@ -115,6 +117,7 @@ void ErrNonfatal(const char * msg, int a1, int a2);
 // Prototypes for exif.c functions.
 int Exif2tm(struct tm * timeptr, char * ExifTime);
 void process_EXIF (unsigned char * CharBuf, unsigned int length);
+void process_EXIF_exposure(unsigned char * ExifSection, unsigned int length);
 void ShowImageInfo(int ShowFileInfo);
 void ShowConciseImageInfo(void);
 const char * ClearOrientation(void);
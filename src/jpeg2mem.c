@@ -8,10 +8,13 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <stddef.h>
+#include <string.h>
 #include <setjmp.h>
 #include <jpeglib.h>
 #include <jerror.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "imgcomp.h"
 #include "jhead.h"
 
@@ -38,91 +41,454 @@ void my_error_exit (j_common_ptr cinfo)
 }
 
 
+//----------------------------------------------------------------------------------------
+// Image buffers that were freed get kept for reuse, so that once running, following a
+// directory doesn't keep allocating and freeing frame sized blocks of memory.
+//----------------------------------------------------------------------------------------
+#define MAX_SPARE_IMAGES 8
+static MemImage_t * SpareImages[MAX_SPARE_IMAGES];
+static int NumSpareImages = 0;
+static pthread_mutex_t SpareLock = PTHREAD_MUTEX_INITIALIZER; // Decode threads use them too.
+
+int FrameAllocs = 0;
+
+//----------------------------------------------------------------------------------------
+// Get an image buffer, with room for the chroma planes if Ycc.
+//----------------------------------------------------------------------------------------
+MemImage_t * NewMemImage(int width, int height, int components, int Ycc)
+{
+    int data_size = width * height * components;
+    if (Ycc) data_size += ((width+1)/2) * ((height+1)/2) * 2;
+
+    // Use the smallest spare buffer that's big enough.
+    MemImage_t * Image = NULL;
+    pthread_mutex_lock(&SpareLock);
+    int best = -1;
+    for (int a=0;a<NumSpareImages;a++){
+        if (SpareImages[a]->BufSize < data_size) continue;
+        if (best < 0 || SpareImages[a]->BufSize < SpareImages[best]->BufSize) best = a;
+    }
+    if (best >= 0){
+        Image = SpareImages[best];
+        SpareImages[best] = SpareImages[--NumSpareImages];
+    }
+    pthread_mutex_unlock(&SpareLock);
+
+    if (Image == NULL){
+        Image = malloc(data_size+offsetof(MemImage_t, pixels));
+        if (!Image){
+            fprintf(Log, "Image malloc failed");
+            return NULL;
+        }
+        Image->BufSize = data_size;
+        COUNT_FRAME_ALLOC();
+    }
+    Image->width = width;
+    Image->height = height;
+    Image->components = components;
+    Image->Ycc = Ycc;
+    return Image;
+}
+
+//----------------------------------------------------------------------------------------
+// Done with an image.  Keep the buffer for the next one.
+//----------------------------------------------------------------------------------------
+void FreeMemImage(MemImage_t * Image)
+{
+    if (Image == NULL) return;
+    pthread_mutex_lock(&SpareLock);
+    if (NumSpareImages < MAX_SPARE_IMAGES){
+        SpareImages[NumSpareImages++] = Image;
+        Image = NULL;
+    }
+    pthread_mutex_unlock(&SpareLock);
+    if (Image){
+        free(Image);
+        COUNT_FRAME_ALLOC();
+    }
+}
+
+//----------------------------------------------------------------------------------------
+// One jpeg decoder gets used for all images (one per thread, with decode threads).
+// Its tables and permanent memory stay allocated between images.  Errors longjmp to
+// the setjmp in whichever load is running.
+//----------------------------------------------------------------------------------------
+static __thread struct jpeg_decompress_struct Decoder;
+static __thread struct my_error_mgr DecoderErr;
+
+static struct jpeg_decompress_struct * GetDecoder(void)
+{
+    static __thread int Made = 0;
+    if (!Made){
+        Decoder.err = jpeg_std_error(&DecoderErr.pub);
+        DecoderErr.pub.error_exit = my_error_exit; // Override library's default exit on error.
+        jpeg_create_decompress(&Decoder);
+        Made = 1;
+    }
+    return &Decoder;
+}
+
 //----------------------------------------------------------------------------------------
 // Use libjpeg to load an image into memory, optionally scale it.
 //----------------------------------------------------------------------------------------
-MemImage_t * LoadJPEG(char* FileName, int scale_denom, int discard_colors, int ParseExif)
+MemImage_t * LoadJPEG(char* FileName, int scale_denom, int DecodeColors, int ParseExif)
 {
-    unsigned long data_size;    // length of the file
-    struct jpeg_decompress_struct info; //for our jpeg info
-    struct my_error_mgr jerr;
-    MemImage_t *MemImage;
-    int components;
-    FILE* file = fopen(FileName, "rb");
+    FileData_t * File = ReadFileData(FileName);
+    if (File == NULL) return NULL;
+    MemImage_t * Image = LoadJPEGRows(File, scale_denom, DecodeColors, ParseExif, NULL, NULL, NULL);
+    FreeFileData(File);
+    return Image;
+}
 
-    if(file == NULL) {
-       fprintf(Log, "Could not open file: \"%s\"!\n", FileName);
-       return NULL;
+//----------------------------------------------------------------------------------------
+// Where libjpeg got to in the file, for error messages.
+//----------------------------------------------------------------------------------------
+static long DecoderPos(FileData_t * File)
+{
+    return File->Size - (long)Decoder.src->bytes_in_buffer;
+}
+
+//----------------------------------------------------------------------------------------
+// Check for the usual camera jpeg layout: YCbCr with chroma at half width and height.
+//----------------------------------------------------------------------------------------
+static int IsYcc420(struct jpeg_decompress_struct * info)
+{
+    jpeg_component_info * comp = info->comp_info;
+    if (info->jpeg_color_space != JCS_YCbCr || info->num_components != 3) return 0;
+    if (comp[0].h_samp_factor != 2 || comp[0].v_samp_factor != 2) return 0;
+    if (comp[1].h_samp_factor != 1 || comp[1].v_samp_factor != 1) return 0;
+    if (comp[2].h_samp_factor != 1 || comp[2].v_samp_factor != 1) return 0;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+// Lines of a component libjpeg hands over per iMCU row (16 luma lines at full scale).
+// When scaling, libjpeg decodes chroma at the same size as luma where it can, to save
+// itself upsampling, so chroma may come in at full size.
+//----------------------------------------------------------------------------------------
+static int RawRows(struct jpeg_decompress_struct * info, int c)
+{
+    return info->comp_info[c].v_samp_factor * info->comp_info[c].DCT_scaled_size;
+}
+static int RawStride(struct jpeg_decompress_struct * info, int c)
+{
+    return info->comp_info[c].width_in_blocks * info->comp_info[c].DCT_scaled_size;
+}
+
+//----------------------------------------------------------------------------------------
+// Read the Y, Cb and Cr planes straight out of the decoder, without upsampling or
+// color conversion.  These come a whole iMCU row at a time, padded out to whole blocks,
+// so they go through RawBuf.  Chroma that came at full size gets averaged down to half.
+//----------------------------------------------------------------------------------------
+static void ReadRawPlanes(struct jpeg_decompress_struct * info, MemImage_t * MemImage,
+        unsigned char * RawBuf, RowFunc_t RowFunc, void * RowArg)
+{
+    int rows = RawRows(info, 0), crows = RawRows(info, 1);
+    int Full = crows == rows;
+    int width = MemImage->width, height = MemImage->height;
+    int cw = CHROMA_W(MemImage), ch = CHROMA_H(MemImage);
+    JSAMPROW YRows[rows], CbRows[crows], CrRows[crows];
+    JSAMPARRAY Planes[3] = {YRows, CbRows, CrRows};
+    int ystride = RawStride(info, 0), cstride = RawStride(info, 1);
+    int r;
+
+    for (r=0;r<rows;r++) YRows[r] = RawBuf + r*ystride;
+    RawBuf += rows*ystride;
+    for (r=0;r<crows;r++){
+        CbRows[r] = RawBuf + r*cstride;
+        CrRows[r] = RawBuf + (crows+r)*cstride;
     }
 
-    if (ParseExif){
-        // Get the exif header
-        ReadExifPart(file);
+    while (info->output_scanline < info->output_height){
+        int y = info->output_scanline;
+        jpeg_read_raw_data(info, Planes, rows);
+
+        // Last iMCU row may go past the bottom of the image.
+        for (r=0;r<rows && y+r < height;r++){
+            memcpy(MemImage->pixels + (y+r)*width, YRows[r], width);
+        }
+        for (r=0;r<rows/2 && y/2+r < ch;r++){
+            unsigned char * cb = CB_PLANE(MemImage) + (y/2+r)*cw;
+            unsigned char * cr = CR_PLANE(MemImage) + (y/2+r)*cw;
+            if (Full){
+                unsigned char * b0 = CbRows[r*2], * b1 = CbRows[r*2+1];
+                unsigned char * r0 = CrRows[r*2], * r1 = CrRows[r*2+1];
+                for (int c=0;c<cw;c++){
+                    cb[c] = (b0[c*2]+b0[c*2+1]+b1[c*2]+b1[c*2+1]+2) >> 2;
+                    cr[c] = (r0[c*2]+r0[c*2+1]+r1[c*2]+r1[c*2+1]+2) >> 2;
+                }
+            }else{
+                memcpy(cb, CbRows[r], cw);
+                memcpy(cr, CrRows[r], cw);
+            }
+        }
+
+        if (RowFunc){
+            RowFunc(MemImage, y, (y+rows < height ? y+rows : height) - y, RowArg);
+        }
     }
+}
 
-    info.err = jpeg_std_error(& jerr.pub);     
-    jerr.pub.error_exit = my_error_exit; // Override library's default exit on error.
+//----------------------------------------------------------------------------------------
+// Load an image, calling RowFunc with each batch of rows as they are decoded.
+// If Crop is given, only that part of the image gets decoded (widened out to whole
+// blocks), and the rest is left black.  Picture coordinates stay the same.
+//----------------------------------------------------------------------------------------
+MemImage_t * LoadJPEGRows(FileData_t * File, int scale_denom, int DecodeColors, int ParseExif,
+        RowFunc_t RowFunc, void * RowArg, const Region_t * Crop)
+{
+    struct jpeg_decompress_struct * info = GetDecoder();
+    MemImage_t * volatile MemImage = NULL;
+    int components;
+    int Ycc = 0;
+    static __thread unsigned char * RawBuf = NULL; // Kept for the next image.
+    static __thread int RawBufSize = 0;
 
+    if (ParseExif){
+        // Get exposure time and ISO from the exif header
+        ReadExposureExif(File->Data, File->Size);
+    }
 
-    if (setjmp(jerr.setjmp_buffer)) {
+    if (setjmp(DecoderErr.setjmp_buffer)) {
         // If we get here, the JPEG code has signaled an error.
-        // We need to clean up the JPEG object, close the input file, and return.
-		fprintf(Log, "Error reading jpeg \"%s\" at %ld\n", FileName, ftell(file));
-        jpeg_destroy_decompress(&info);
-        fclose(file);
+        // We need to reset the JPEG object and return.
+		fprintf(Log, "Error reading jpeg \"%s\" at %ld\n", File->Name, DecoderPos(File));
+        FreeMemImage(MemImage);
+        jpeg_abort_decompress(info);
         return NULL;
     }
 
-    jpeg_create_decompress(& info);   // fills info structure
+    jpeg_mem_src(info, File->Data, File->Size);
+    jpeg_read_header(info, TRUE);   // read jpeg file header
 
-    jpeg_stdio_src(&info, file);    
-    jpeg_read_header(&info, TRUE);   // read jpeg file header
+    if (DecodeColors == DECODE_LUMA) info->out_color_space = JCS_GRAYSCALE;
+    if (DecodeColors == DECODE_YCC && IsYcc420(info)){
+        info->raw_data_out = TRUE;
+        Ycc = 1;
+    }
 
-    if (discard_colors) info.out_color_space = JCS_GRAYSCALE;
+    info->scale_num = 1;
+    info->scale_denom = scale_denom;
 
-    info.scale_num = 1;
-    info.scale_denom = scale_denom;
+    info->do_fancy_upsampling = FALSE;
 
-    info.num_components = 3;
-    info.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(info);    // decompress the file
 
-    jpeg_start_decompress(&info);    // decompress the file
+    components = info->out_color_space == JCS_GRAYSCALE || Ycc ? 1 : 3;
 
-    components = info.out_color_space == JCS_GRAYSCALE ? 1 : 3;
+    MemImage = NewMemImage(info->output_width, info->output_height, components, Ycc);
+    if (!MemImage){
+        jpeg_abort_decompress(info);
+        return NULL;
+    }
 
-    data_size = info.output_width 
-              * info.output_height * components;
+    if (Ycc){
+        int Size = RawRows(info, 0)*RawStride(info, 0) + 2*RawRows(info, 1)*RawStride(info, 1);
+        if (Size > RawBufSize){
+            free(RawBuf);
+            RawBuf = malloc(Size);
+            RawBufSize = Size;
+            COUNT_FRAME_ALLOC();
+        }
+        ReadRawPlanes(info, MemImage, RawBuf, RowFunc, RowArg);
+    }
 
-    MemImage = malloc(data_size+offsetof(MemImage_t, pixels));
-    if (!MemImage){
-        fprintf(Log, "Image malloc failed");
-        return 0;
+    int width = MemImage->width;
+    int height = MemImage->height;
+    int rowbytes = width*components;
+    JDIMENSION CropX = 0, CropW = width;
+    int LastRow = height;
+    if (Crop && !Ycc){
+        Region_t Box = *Crop;
+        if (Box.x2 > width) Box.x2 = width;
+        if (Box.y2 > height) Box.y2 = height;
+        if (Box.x1 < 0) Box.x1 = 0;
+        if (Box.y1 < 0) Box.y1 = 0;
+        if (Box.x2 > Box.x1 && Box.y2 > Box.y1){
+            if (Box.x1 > 0 || Box.x2 < width){
+                CropX = Box.x1;
+                CropW = Box.x2-Box.x1;
+                jpeg_crop_scanline(info, &CropX, &CropW); // Widens it to whole blocks.
+            }
+            LastRow = Box.y2;
+            if (Box.y1 > 0){
+                memset(MemImage->pixels, 0, Box.y1*rowbytes);
+                jpeg_skip_scanlines(info, Box.y1);
+            }
+        }
     }
-    MemImage->width = info.output_width;
-    MemImage->height = info.output_height;
-    MemImage->components = components;
 
     //--------------------------------------------
     // read scanlines one at a time. Assumes an RGB image
     //--------------------------------------------
-    while (info.output_scanline < info.output_height){ // loop
+    int RowsReported = 0;
+    while ((int)info->output_scanline < LastRow){ // loop
         unsigned char * rowptr[1];  // pointer to an array
         // Enable jpeg_read_scanlines() to fill our jdata array
-        rowptr[0] = MemImage->pixels + 
-            components * info.output_width * info.output_scanline; 
-        jpeg_read_scanlines(&info, rowptr, 1);
+        rowptr[0] = MemImage->pixels + rowbytes * info->output_scanline;
+        if (CropW < (JDIMENSION)width){
+            memset(rowptr[0], 0, CropX*components);
+            memset(rowptr[0]+(CropX+CropW)*components, 0, (width-CropX-CropW)*components);
+            rowptr[0] += CropX*components;
+        }
+        jpeg_read_scanlines(info, rowptr, 1);
+
+        if (RowFunc && (info->output_scanline-RowsReported >= 16 || (int)info->output_scanline == LastRow)){
+            // Hand rows over in small batches while they are still in cache.
+            RowFunc(MemImage, RowsReported, info->output_scanline-RowsReported, RowArg);
+            RowsReported = info->output_scanline;
+        }
     }
     //---------------------------------------------------
 
-    jpeg_finish_decompress(&info);   //finish decompressing
-    fclose(file);                    //close the file
-
-    jpeg_destroy_decompress(&info);
+    if (LastRow < height){
+        // Don't bother decoding the rest.
+        memset(MemImage->pixels+LastRow*rowbytes, 0, (height-LastRow)*rowbytes);
+        if (RowFunc) RowFunc(MemImage, LastRow, height-LastRow, RowArg);
+        jpeg_abort_decompress(info);
+    }else{
+        jpeg_finish_decompress(info);   //finish decompressing
+    }
 
     return MemImage;
 }
 
 
+//----------------------------------------------------------------------------------------
+// Read just the DC coefficients of the luma blocks, without doing any inverse DCT.
+// Gives a gray image with one pixel per 8x8 block at full scale, holding the block's
+// average brightness.  Also gets the size the picture would decode to at scale_denom.
+// Returns NULL for layouts where luma doesn't have the full resolution.
+//----------------------------------------------------------------------------------------
+MemImage_t * LoadJPEGDc(FileData_t * File, int scale_denom, int ParseExif, int * pWidth, int * pHeight)
+{
+    struct jpeg_decompress_struct * info = GetDecoder();
+    MemImage_t * volatile Dc = NULL;
+
+    if (ParseExif){
+        // Get exposure time and ISO from the exif header
+        ReadExposureExif(File->Data, File->Size);
+    }
+
+    if (setjmp(DecoderErr.setjmp_buffer)) {
+		fprintf(Log, "Error reading jpeg \"%s\" at %ld\n", File->Name, DecoderPos(File));
+        FreeMemImage(Dc);
+        jpeg_abort_decompress(info);
+        return NULL;
+    }
+
+    jpeg_mem_src(info, File->Data, File->Size);
+    jpeg_read_header(info, TRUE);
+
+    info->scale_num = 1;
+    info->scale_denom = scale_denom;
+    jpeg_calc_output_dimensions(info);
+    *pWidth = info->output_width;
+    *pHeight = info->output_height;
+
+    jpeg_component_info * comp = &info->comp_info[0];
+    if (comp->h_samp_factor != info->max_h_samp_factor || comp->v_samp_factor != info->max_v_samp_factor){
+        jpeg_abort_decompress(info);
+        return NULL;
+    }
+
+    jvirt_barray_ptr * coefs = jpeg_read_coefficients(info);
+
+    int bw = comp->width_in_blocks;
+    int bh = comp->height_in_blocks;
+    int q = comp->quant_table->quantval[0];
+    Dc = NewMemImage(bw, bh, 1, 0);
+
+    for (int by=0;by<bh;by++){
+        JBLOCKARRAY rows = (*info->mem->access_virt_barray)((j_common_ptr)info, coefs[0], by, 1, FALSE);
+        unsigned char * dst = Dc->pixels+by*bw;
+        for (int bx=0;bx<bw;bx++){
+            // DC is 8x the block's average, less the 128 level shift.
+            int v = (rows[0][bx][0]*q+4)/8 + 128;
+            dst[bx] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+    }
+
+    jpeg_finish_decompress(info);
+
+    return Dc;
+}
+
+
+//----------------------------------------------------------------------------------------
+// Have the decoder keep APPn and comment markers, or go back to skipping them.
+//----------------------------------------------------------------------------------------
+static void KeepMarkers(struct jpeg_decompress_struct * info, int Keep)
+{
+    for (int m=0;m<16;m++) jpeg_save_markers(info, JPEG_APP0+m, Keep ? 0xffff : 0);
+    jpeg_save_markers(info, JPEG_COM, Keep ? 0xffff : 0);
+}
+
+//----------------------------------------------------------------------------------------
+// Losslessly rewrite a jpeg with optimized huffman tables, and optionally progressive,
+// like jpegtran does.  Works on the DCT coefficients, so nothing gets decoded.  Markers
+// like exif get copied over.  Returns 0 if it couldn't be done.
+//----------------------------------------------------------------------------------------
+int WriteOptimizedJpeg(FileData_t * File, char * DstName, int Progressive)
+{
+    struct jpeg_decompress_struct * info = GetDecoder();
+    static __thread struct jpeg_compress_struct Encoder;
+    static __thread int Made = 0;
+    FILE * volatile outfile = NULL;
+
+    if (!Made){
+        Encoder.err = &DecoderErr.pub; // Errors from either go to the same setjmp.
+        jpeg_create_compress(&Encoder);
+        Made = 1;
+    }
+
+    if (setjmp(DecoderErr.setjmp_buffer)) {
+        fprintf(Log, "Error optimizing jpeg \"%s\" to \"%s\"\n", File->Name, DstName);
+        jpeg_abort_compress(&Encoder);
+        jpeg_abort_decompress(info);
+        KeepMarkers(info, 0);
+        if (outfile){
+            fclose(outfile);
+            unlink(DstName);
+        }
+        return 0;
+    }
+
+    // The decoder is shared with loading frames, which don't need the markers kept.
+    KeepMarkers(info, 1);
+
+    jpeg_mem_src(info, File->Data, File->Size);
+    jpeg_read_header(info, TRUE);
+    jvirt_barray_ptr * coefs = jpeg_read_coefficients(info);
+
+    jpeg_copy_critical_parameters(info, &Encoder);
+    Encoder.optimize_coding = TRUE;
+    if (Progressive) jpeg_simple_progression(&Encoder);
+
+    outfile = fopen(DstName, "wb");
+    if (outfile == NULL){
+        fprintf(Log, "Could not open %s\n", DstName);
+        longjmp(DecoderErr.setjmp_buffer, 1);
+    }
+    jpeg_stdio_dest(&Encoder, outfile);
+    jpeg_write_coefficients(&Encoder, coefs);
+
+    for (jpeg_saved_marker_ptr mk = info->marker_list; mk; mk = mk->next){
+        // The encoder already wrote its own JFIF or Adobe marker, if it needed one.
+        if (Encoder.write_JFIF_header && mk->marker == JPEG_APP0 && mk->data_length >= 5
+                && memcmp(mk->data, "JFIF", 5) == 0) continue;
+        if (Encoder.write_Adobe_marker && mk->marker == JPEG_APP0+14 && mk->data_length >= 5
+                && memcmp(mk->data, "Adobe", 5) == 0) continue;
+        jpeg_write_marker(&Encoder, mk->marker, mk->data, mk->data_length);
+    }
+
+    jpeg_finish_compress(&Encoder);
+    jpeg_finish_decompress(info);
+    KeepMarkers(info, 0);
+
+    fclose(outfile);
+    return 1;
+}
 
 //----------------------------------------------------------------------------------------
 // Write an image to disk - for testing.  Not jpeg (ppm is a much simpler format)
@@ -66,17 +66,39 @@ static void process_SOFn (const uchar * Data, int marker)
 
 
 
+//--------------------------------------------------------------------------
+// Where the jpeg header comes from: a file, or a file already read into memory.
+//--------------------------------------------------------------------------
+typedef struct {
+    FILE * infile;
+    const uchar * Data;
+    int Size;
+    int Pos;
+}ExifSrc_t;
+
+static int SrcGetc(ExifSrc_t * Src)
+{
+    if (Src->infile) return fgetc(Src->infile);
+    if (Src->Pos >= Src->Size) return EOF;
+    return Src->Data[Src->Pos++];
+}
+
+static long SrcTell(ExifSrc_t * Src)
+{
+    return Src->infile ? ftell(Src->infile) : Src->Pos;
+}
+
 //--------------------------------------------------------------------------
 // Parse the marker stream until SOS or EOI is seen;
 //--------------------------------------------------------------------------
-static int FindExifInFile (FILE * infile)
+static int FindExif(ExifSrc_t * Src)
 {
     int a;
     int have_exif = 0, have_sof= 0;
     int SectionsRead = 0;
-    a = fgetc(infile);
+    a = SrcGetc(Src);
 
-    if (a != 0xff || fgetc(infile) != M_SOI){
+    if (a != 0xff || SrcGetc(Src) != M_SOI){
         return FALSE;
     }
 
@@ -85,11 +107,12 @@ static int FindExifInFile (FILE * infile)
         int marker = 0;
         int prev;
         int ll,lh, got;
-        uchar * Data;
+        const uchar * Data;
+        static uchar Buf[65536]; // Sections are at most this big.
 
         for (a=0;;a++){
             prev = marker;
-            marker = fgetc(infile);
+            marker = SrcGetc(Src);
             if (marker != 0xff && prev == 0xff) break;
             if (marker == EOF){
                 fprintf(Log, "Unexpected end of file");
@@ -104,10 +127,10 @@ static int FindExifInFile (FILE * infile)
 
  
         // Read the length of the section.
-        lh = fgetc(infile);
-        ll = fgetc(infile);
+        lh = SrcGetc(Src);
+        ll = SrcGetc(Src);
         if (lh == EOF || ll == EOF){
-            fprintf(Log, "Unexpected end of file at %ld",ftell(infile));
+            fprintf(Log, "Unexpected end of file at %ld",SrcTell(Src));
             return 0;
         }
 
@@ -118,17 +141,19 @@ static int FindExifInFile (FILE * infile)
             return 0;
         }
 
-        Data = (uchar *)malloc(itemlen);
-        if (Data == NULL){
-            fprintf(Log, "Could not allocate memory");
-            return 0;
+        if (Src->infile){
+            // Store first two pre-read bytes.
+            Buf[0] = (uchar)lh;
+            Buf[1] = (uchar)ll;
+
+            got = fread(Buf+2, 1, itemlen-2, Src->infile); // Read the whole section.
+            Data = Buf;
+        }else{
+            // Already in memory, length bytes and all.
+            got = Src->Size-Src->Pos < itemlen-2 ? Src->Size-Src->Pos : itemlen-2;
+            Data = Src->Data+Src->Pos-2;
+            Src->Pos += got;
         }
-
-        // Store first two pre-read bytes.
-        Data[0] = (uchar)lh;
-        Data[1] = (uchar)ll;
-
-        got = fread(Data+2, 1, itemlen-2, infile); // Read the whole section.
         if (got != itemlen-2){
             fprintf(Log, "Premature end of file?");
             return 0;
@@ -139,7 +164,7 @@ static int FindExifInFile (FILE * infile)
         switch(marker){        
             case M_EXIF:
                 if (memcmp(Data+2, "Exif", 4) == 0){
-                    process_EXIF(Data, itemlen);
+                    process_EXIF((uchar *)Data, itemlen);
                     have_exif = 1;
                 }
                 break;
@@ -171,8 +196,6 @@ static int FindExifInFile (FILE * infile)
                 SectionsRead += 100; //Stop reading stuff!
                 break;
         }
-        free(Data);
-        
         if (have_exif && have_sof) break;
         if (SectionsRead > 4) break; // Don't read too far!
     }
@@ -185,11 +208,26 @@ static int FindExifInFile (FILE * infile)
 int ReadExifPart(FILE * infile)
 {
     int a;
-    a = FindExifInFile(infile);
+    ExifSrc_t Src = {infile, NULL, 0, 0};
+    a = FindExif(&Src);
     rewind(infile); // go back to start for libexif to read the image.
     return a;
 }
 
+//--------------------------------------------------------------------------
+// Same, for a jpeg file that was read into memory.
+//--------------------------------------------------------------------------
+int ReadExifMem(const uchar * Data, int Size)
+{
+    ExifSrc_t Src = {NULL, Data, Size, 0};
+    return FindExif(&Src);
+}
+
+
+
+
+
+
 
 
 
@@ -211,9 +249,36 @@ int ReadExifPart(FILE * infile)
 
 
 
+    
 
+//--------------------------------------------------------------------------
+// Just get what exposure management needs from a jpeg file in memory.
+// Skips from marker to marker, only the exif section gets looked at.
+//--------------------------------------------------------------------------
+int ReadExposureExif(const uchar * Data, int Size)
+{
+    int Pos = 2;
 
+    if (Size < 4 || Data[0] != 0xff || Data[1] != M_SOI) return FALSE;
 
+    while (Pos+4 <= Size){
+        int marker, itemlen;
+        if (Data[Pos] != 0xff) return FALSE;
+        marker = Data[Pos+1];
+        if (marker == 0xff){
+            Pos += 1; // Padding
+            continue;
+        }
+        if (marker == M_SOS || marker == M_EOI) break;
 
+        itemlen = Get16m(Data+Pos+2);
+        if (itemlen < 2 || Pos+2+itemlen > Size) break;
 
-    
\ No newline at end of file
+        if (marker == M_EXIF && memcmp(Data+Pos+4, "Exif", 4) == 0){
+            process_EXIF_exposure((uchar *)Data+Pos+2, itemlen);
+            return TRUE;
+        }
+        Pos += 2+itemlen;
+    }
+    return FALSE;
+}
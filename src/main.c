@@ -17,14 +17,15 @@
 
 #include "imgcomp.h"
 #include "config.h"
+#include "jhead.h"
 #include <sys/inotify.h>
 #include <poll.h>
-
-static int SinceMotionPix = 1000;
-static int SinceMotionMs = 0;
+#include <signal.h>
 
 typedef struct {
-    MemImage_t *Image;
+    MemImage_t *Image;      // With dctfilter, only decoded when it needs comparing.
+    FileData_t *File;       // The jpeg file, read in once.
+    int Loaded;
     char Name[500];
     int nind; // Name part index.
     time_t mtime;
@@ -32,16 +33,50 @@ typedef struct {
     int IsTimelapse;
     int IsMotion;
     int IsSkipFatigue;
+    FrameFeatures_t Features; // Reused by every comparison this picture is in.
 }LastPic_t;
 
-static LastPic_t LastPics[3];
-static time_t NextTimelapsePix;
+// Everything about one camera.  With camera sections in the configuration file,
+// one imgcomp handles several cameras, taking turns between them.
+typedef struct {
+    CamConfig_t * Conf;
+    CompareContext_t * Detector;
+    CameraProg_t Prog;
+    LastPic_t LastPics[3];
+    time_t NextTimelapsePix;
+    int SinceMotionPix;
+    int SinceMotionMs;
+    int FatigueSkipCountdown;
+    int NumProcessed;       // Frames processed since camera program was last checked on
+    int Backlog;            // Frames left over for the next turn
+    int ShedLevel;          // 0 = keeping up, 1 = skipping frames, 2 = also decoding coarser
+    int ShedSkipped, ShedSaved, ShedCoarse; // Counts for while behind
+    int Watched;            // Frames come from inotify events instead of scanning the directory
+    int Rescan;             // Scan the directory anyway (at startup, or events were lost)
+    DirEntry_t * Pending;   // Frames that inotify reported, in the order they arrived
+    int NumPending, PendingAlloc;
+    int EventFd;            // inotify descriptor of the directory
+}Camera_t;
+
+static Camera_t Cameras[MAX_CAMERAS];
+static int NumCameras;
+static Camera_t * Cam;      // Camera being worked on.
+
+// Frames to process from each camera before moving on to the next one.
+#define FRAMES_PER_TURN 2
 
 time_t LastPic_mtime;
 
 static int AngleAdjusted = 0;
 
-int FatigueSkipCountdown = 0;
+//-----------------------------------------------------------------------------------
+// Make a camera the one being worked on.
+//-----------------------------------------------------------------------------------
+static void SelectCamera(Camera_t * c)
+{
+    Cam = c;
+    SetCamConfig(c->Conf);
+}
 
 //-----------------------------------------------------------------------------------
 // Convert picture coordinates to relative (0-1000) on image.
@@ -50,65 +85,117 @@ static void GeometryConvert(TriggerInfo_t  * Trig)
 {
     double x,y;
 
-    x = ((float)Trig->x/(LastPics[0].Image->width*ScaleDenom));
-    y = ((float)Trig->y/(LastPics[0].Image->height*ScaleDenom));
+    x = ((float)Trig->x/(Cam->Detector->DiffVal->w*Cam->Detector->ScaleDenom));
+    y = ((float)Trig->y/(Cam->Detector->DiffVal->h*Cam->Detector->ScaleDenom));
 
     Trig->x = (int)((x-0.5)*1000);
     Trig->y = (int)((0.5-y)*1000);
 }
 
 
+//-----------------------------------------------------------------------------------
+// Read a picture.  With dctfilter, only its DC coefficients get read, and it gets
+// decoded later if it needs a full compare.  Returns 0 if it couldn't be read.
+//-----------------------------------------------------------------------------------
+static int LoadPic(LastPic_t * Pic, LastPic_t * Prev, int ParseExif)
+{
+    int Denom = Cam->Detector->ScaleDenom;
+    if (Pic->File == NULL){
+        Pic->File = ReadFileData(Pic->Name);
+        if (Pic->File == NULL) return 0;
+    }
+    if (Cam->Detector->DctPercent && LoadDcFeatures(Pic->File, Denom, ParseExif, &Pic->Features)){
+        Pic->Loaded = 1;
+        return 1;
+    }
+    if (FusedCompare && Prev){
+        // Compare to previous picture while decoding.
+        Pic->Image = LoadJPEGCompare(Cam->Detector, Pic->File, Denom, ParseExif, Prev->Image, &Prev->Features);
+    }else{
+        Pic->Image = LoadJPEGDetect(Cam->Detector, Pic->File, Denom, ParseExif);
+    }
+    Pic->Loaded = Pic->Image != NULL;
+    if (!Pic->Loaded){
+        FreeFileData(Pic->File);
+        Pic->File = NULL;
+    }
+    return Pic->Loaded;
+}
+
+//-----------------------------------------------------------------------------------
+// Decode a picture that only had its DC coefficients read.
+//-----------------------------------------------------------------------------------
+static int DecodePic(LastPic_t * Pic, LastPic_t * Prev)
+{
+    if (Pic->Image) return 1;
+    int Denom = Cam->Detector->ScaleDenom;
+    if (FusedCompare && Prev && Prev->Image){
+        Pic->Image = LoadJPEGCompare(Cam->Detector, Pic->File, Denom, 0, Prev->Image, &Prev->Features);
+    }else{
+        Pic->Image = LoadJPEGDetect(Cam->Detector, Pic->File, Denom, 0);
+    }
+    return Pic->Image != NULL;
+}
+
 //-----------------------------------------------------------------------------------
 // Figure out which images should be saved.
 //-----------------------------------------------------------------------------------
 static int ProcessImage(LastPic_t * New, int DeleteProcessed)
 {
-    LastPics[2] = LastPics[1];
-    LastPics[1] = LastPics[0];
+    Cam->LastPics[2] = Cam->LastPics[1];
+    Cam->LastPics[1] = Cam->LastPics[0];
 
-    LastPics[0] = *New;
-    LastPics[0].IsMotion = LastPics[0].IsTimelapse = 0;
+    Cam->LastPics[0] = *New;
+    Cam->LastPics[0].IsMotion = Cam->LastPics[0].IsTimelapse = 0;
 
 // if lights, or motion report, also do motion detect without fatigue.
 // But DoMotionRun is called from parent function to do the lights.
 
     TriggerInfo_t Trig;
-    TriggerInfo_t Trig_nf;
-    Trig_nf.DiffLevel = Trig.DiffLevel = 0;
-    TriggerInfo_t* Trig_nf_p = NULL;
+    TriggerList_t Objs_nf;
+    TriggerInfo_t * Trig_nf = &Objs_nf.Objects[0];
+    Objs_nf.NumObjects = 0;
+    Trig_nf->DiffLevel = Trig.DiffLevel = 0;
+    TriggerList_t* Trig_nf_p = NULL;
+    int Saved = 0;
     if (UdpDest[0] || lighton_run[0]){
         // Also need unfatigued motion detection for triggering stuff.
-        Trig_nf_p = &Trig_nf;
+        Trig_nf_p = &Objs_nf;
     }
 
 
-    if (LastPics[1].Image != NULL){
+    if (Cam->LastPics[1].Loaded){
         // Handle timelapsing.
         if (TimelapseInterval >= 1){
-            if (LastPics[0].mtime >= NextTimelapsePix){
-                LastPics[0].IsTimelapse = 1;
+            if (Cam->LastPics[0].mtime >= Cam->NextTimelapsePix){
+                Cam->LastPics[0].IsTimelapse = 1;
             }
 
             // Figure out when the next timelapse interval should be.
-            NextTimelapsePix = LastPics[0].mtime+TimelapseInterval;
-            NextTimelapsePix -= (NextTimelapsePix % TimelapseInterval);
+            Cam->NextTimelapsePix = Cam->LastPics[0].mtime+TimelapseInterval;
+            Cam->NextTimelapsePix -= (Cam->NextTimelapsePix % TimelapseInterval);
         }
 
         // compare with previous picture.
         Trig.DiffLevel = Trig.x = Trig.y = 0;
 
         int SkipFatigue = 0;
-        if (FatigueSkipCount && ++FatigueSkipCountdown >= FatigueSkipCount){
-            FatigueSkipCountdown = 0;
+        if (FatigueSkipCount && ++Cam->FatigueSkipCountdown >= FatigueSkipCount){
+            Cam->FatigueSkipCountdown = 0;
             SkipFatigue = 1;
         }
 
-        if (LastPics[1].Image){
-            Trig = ComparePix(LastPics[1].Image, LastPics[0].Image, 1, SkipFatigue, NULL, Trig_nf_p);
+        if (Cam->Detector->DctPercent && DcPrefilter(Cam->Detector, &Cam->LastPics[1].Features,
+                &Cam->LastPics[0].Features, Trig_nf_p, &Trig)){
+            // Clearly not enough change, no need to decode.
+        }else if (DecodePic(&Cam->LastPics[1], NULL) && DecodePic(&Cam->LastPics[0], &Cam->LastPics[1])){
+            Trig = ComparePix(Cam->Detector, Cam->LastPics[1].Image, Cam->LastPics[0].Image,
+                    &Cam->LastPics[1].Features, &Cam->LastPics[0].Features,
+                    1, SkipFatigue, NULL, Trig_nf_p);
         }
 
-        LastPics[0].DiffMag = Trig.DiffLevel;
-        LastPics[0].IsSkipFatigue = SkipFatigue;
+        Cam->LastPics[0].DiffMag = Trig.DiffLevel;
+        Cam->LastPics[0].IsSkipFatigue = SkipFatigue;
 
         if (FollowDir){
             // When real-time following, the timestamp is more useful than the file name
@@ -116,82 +203,96 @@ static int ProcessImage(LastPic_t * New, int DeleteProcessed)
             strftime(TimeString, 10, "%H%M%S ", localtime(&LastPic_mtime));
             fputs(TimeString,Log);
         }else{
-            fprintf(Log,"%s: ",LastPics[0].Name+LastPics[0].nind);
+            fprintf(Log,"%s: ",Cam->LastPics[0].Name+Cam->LastPics[0].nind);
         }
+        if (NumCameras > 1) fprintf(Log,"%s ", Cam->Conf->Name);
         if (Trig.DiffLevel){
             fprintf(Log,"%4d", Trig.DiffLevel);
             if (Trig.DiffLevel*5 >= Sensitivity){
                 fprintf(Log," (%4d,%4d)", Trig.x, Trig.y);
             }
-            SinceMotionMs = 0;
+            Cam->SinceMotionMs = 0;
         }
 
-        if (LastPics[0].DiffMag >= Sensitivity){
-            LastPics[0].IsMotion = 1;
+        if (Cam->LastPics[0].DiffMag >= Sensitivity){
+            Cam->LastPics[0].IsMotion = 1;
         }
 
-        if (SpuriousReject && LastPics[2].Image &&
-            LastPics[0].IsMotion && LastPics[1].IsMotion
-            && LastPics[2].DiffMag < Sensitivity/2){
-            // Compare to picture before last picture.
-            Trig = ComparePix(LastPics[2].Image, LastPics[0].Image, 0, 1, NULL, NULL);
+        if (SpuriousReject && Cam->LastPics[2].Loaded &&
+            Cam->LastPics[0].IsMotion && Cam->LastPics[1].IsMotion
+            && Cam->LastPics[2].DiffMag < Sensitivity/2
+            && DecodePic(&Cam->LastPics[2], NULL) && DecodePic(&Cam->LastPics[0], NULL)){
+            // Compare to picture before last picture, around where the motion was.
+            Trig = RecheckPix(Cam->Detector, Cam->LastPics[2].Image, Cam->LastPics[0].Image,
+                    &Cam->LastPics[2].Features, &Cam->LastPics[0].Features, Trig);
 
             //printf("Diff with pix before last: %d\n",Trig.DiffLevel);
             if (Trig.DiffLevel < Sensitivity){
                 // An event that was just one frame.  We assume this was something
                 // spurious, like an insect or a rain drop or a camera glitch.
                 printf(" (spurious %d, ignore)", Trig.DiffLevel);
-                LastPics[0].IsMotion = 0;
-                LastPics[1].IsMotion = 0;
+                Cam->LastPics[0].IsMotion = 0;
+                Cam->LastPics[1].IsMotion = 0;
             }
         }
-        if (LastPics[0].IsMotion){
+        if (Cam->LastPics[0].IsMotion){
             fprintf(Log," (motion)");
-            if (LastPics[0].IsSkipFatigue) fprintf(Log, " (sf)");
+            if (Cam->LastPics[0].IsSkipFatigue) fprintf(Log, " (sf)");
         }
-        if (LastPics[0].IsTimelapse) fprintf(Log," (time)");
+        if (Cam->LastPics[0].IsTimelapse) fprintf(Log," (time)");
 
 
         if (SaveDir[0]){
             int KeepImage = 0;
-            if (LastPics[2].IsTimelapse) KeepImage = 1;
-            if (LastPics[1].IsMotion && PreMotionKeep) KeepImage |= 2;
-            if (LastPics[2].IsMotion) KeepImage |= 4;
-            if (SinceMotionPix <= PostMotionKeep) KeepImage |= 8;
+            if (Cam->LastPics[2].IsTimelapse) KeepImage = 1;
+            if (Cam->LastPics[1].IsMotion && PreMotionKeep) KeepImage |= 2;
+            if (Cam->LastPics[2].IsMotion) KeepImage |= 4;
+            if (Cam->SinceMotionPix <= PostMotionKeep) KeepImage |= 8;
 
             if (KeepImage){
-                //printf(" (%s %d)",LastPics[2].Name, KeepImage);
-                BackupImageFile(LastPics[2].Name, LastPics[2].DiffMag, 0);
+                //printf(" (%s %d)",Cam->LastPics[2].Name, KeepImage);
+                // The save takes over the file, and deletes the frame when done with it.
+                SaveFrame(Cam->LastPics[2].Name, Cam->LastPics[2].File, Cam->LastPics[2].DiffMag, DeleteProcessed);
+                Cam->LastPics[2].File = NULL;
+                Saved = 1;
             }
         }
 
-        if (LastPics[2].IsMotion) SinceMotionPix = 0;
+        if (Cam->LastPics[2].IsMotion) Cam->SinceMotionPix = 0;
 
         fprintf(Log,"\n");
-        SinceMotionPix += 1;
+        Cam->SinceMotionPix += 1;
 
 
-        if (UdpDest[0] && Trig_nf.DiffLevel >= Sensitivity){
+        if (UdpDest[0]){
             // Use un-fatigued diff level for reporting motion via UDP.
-            GeometryConvert(&Trig_nf);
+            // One packet for each separate area of motion.
+            for (int a=0;a<Objs_nf.NumObjects;a++){
+                TriggerInfo_t * Obj = &Objs_nf.Objects[a];
+                if (Obj->DiffLevel < Sensitivity) continue;
+                GeometryConvert(Obj);
 
-            printf("Send UDP motion %d,%d\n", Trig_nf.x, Trig_nf.y);
+                printf("Send UDP motion %d,%d\n", Obj->x, Obj->y);
 
-            SendUDP(Trig_nf.x, Trig_nf.y, Trig_nf.DiffLevel, Trig_nf.Motion);
+                SendUDP(Obj->x, Obj->y, Obj->DiffLevel, Cam->LastPics[0].IsMotion);
+            }
         }
 
         Raspistill_restarted = 0;
     }
 
-    if (LastPics[2].Image){
+    if (Cam->LastPics[2].Loaded){
         // Third picture now falls out of the window.  Free it and delete it.
-        free(LastPics[2].Image);
+        FreeMemImage(Cam->LastPics[2].Image);
+        FreeFrameFeatures(&Cam->LastPics[2].Features);
+        FreeFileData(Cam->LastPics[2].File);
+        Cam->LastPics[2].File = NULL;
     }
 
-    if (DeleteProcessed){
-        unlink(LastPics[2].Name);
+    if (DeleteProcessed && !Saved){
+        unlink(Cam->LastPics[2].Name);
     }
-    if (Trig_nf.DiffLevel >= Sensitivity || Trig.DiffLevel >= Sensitivity){
+    if (Trig_nf->DiffLevel >= Sensitivity || Trig.DiffLevel >= Sensitivity){
         // Return un-fatigued motion detection (if we have it) -- used for turning on lights.
         return 1;
     }
@@ -199,178 +300,590 @@ static int ProcessImage(LastPic_t * New, int DeleteProcessed)
 }
 
 //-----------------------------------------------------------------------------------
-// Process a whole directory of files.
+// Check if a directory entry is a jpeg that is still waiting to be processed.
 //-----------------------------------------------------------------------------------
-static int NumProcessed;
-static int DoDirectoryFunc(char * Directory, int DeleteProcessed)
+static int IsWaitingFrame(char * Name)
+{
+    int l = strlen(Name);
+    if (l < 5) return 0;
+    if (strcmp(Name+l-4, ".jpg") != 0 && strcmp(Name+l-5, ".jpeg") != 0) return 0;
+    if (strcmp(Cam->LastPics[0].Name+Cam->LastPics[0].nind, Name) == 0) return 0;
+    if (strcmp(Cam->LastPics[1].Name+Cam->LastPics[1].nind, Name) == 0) return 0;
+    return 1;
+}
+
+//-----------------------------------------------------------------------------------
+// Change the scale images get decoded at.  The pictures that new ones still get
+// compared against are decoded over again at the new scale.
+//-----------------------------------------------------------------------------------
+static void SetDecodeScale(int Denom)
 {
-    DirEntry_t * FileNames;
-    int NumEntries;
     int a;
-    int SawMotion;
+    if (Denom == Cam->Detector->ScaleDenom) return;
+    if (!SetCompareScale(Cam->Detector, Denom)) return;
+
+    for (a=0;a<2;a++){
+        LastPic_t * Pic = &Cam->LastPics[a];
+        if (!Pic->Loaded) continue;
+        FreeMemImage(Pic->Image);
+        Pic->Image = NULL;
+        FreeFrameFeatures(&Pic->Features);
+        LoadPic(Pic, NULL, 0);
+    }
+}
 
-    SawMotion = 0;
+//-----------------------------------------------------------------------------------
+// Decide how much load to shed, from how many frames are waiting and how old the
+// oldest one is.  Goes up a level each time a limit is still exceeded, and back
+// down a level each time both are under half.
+//-----------------------------------------------------------------------------------
+static void UpdateShedLevel(int NumWaiting, int OldestAge)
+{
+    int Level = Cam->ShedLevel;
+    int MaxLevel = 1;
 
-    FileNames = GetSortedDir(Directory, &NumEntries);
-    if (FileNames == NULL) return 0;
-    if (NumEntries == 0) return 0;
+    if (ScaleDenom*2 <= 8 && !Cam->Detector->WeightMapFromFile) MaxLevel = 2;
 
-    NumProcessed = 0;
+    if ((MaxBacklog && NumWaiting > MaxBacklog) || (MaxLag && OldestAge > MaxLag)){
+        if (Level < MaxLevel) Level += 1;
+    }else if ((!MaxBacklog || NumWaiting <= MaxBacklog/2) && (!MaxLag || OldestAge <= MaxLag/2)){
+        if (Level > 0) Level -= 1;
+    }
+    if (Level == Cam->ShedLevel) return;
 
-    for (a=0;a<NumEntries;a++){
-        LastPic_t NewPic;
-        char * ThisName;
-        int l;
-        time_t now = time(NULL);
+    fprintf(Log, "%d frames waiting, oldest %d sec: shed level %d\n", NumWaiting, OldestAge, Level);
+    if (Level == 0){
+        fprintf(Log, "Caught up.  Skipped %d frames (%d saved), %d decoded at 1/%d scale\n",
+                Cam->ShedSkipped, Cam->ShedSaved, Cam->ShedCoarse, ScaleDenom*2);
+        Cam->ShedSkipped = Cam->ShedSaved = Cam->ShedCoarse = 0;
+    }
+    Cam->ShedLevel = Level;
+    SetDecodeScale(Level >= 2 ? ScaleDenom*2 : ScaleDenom);
+}
 
-        // Check that name ends in ".jpg", ".jpeg"
-        ThisName = FileNames[a].FileName;
-        if (ThisName[0] == 0) continue; // We already did this one.
+//-----------------------------------------------------------------------------------
+// Skip over a frame to catch up.  It still gets saved if there is motion going on.
+//-----------------------------------------------------------------------------------
+static void ShedFrame(char * Name, int DeleteProcessed)
+{
+    if (SaveDir[0] && (Cam->LastPics[0].IsMotion || Cam->LastPics[1].IsMotion
+                        || Cam->SinceMotionPix <= PostMotionKeep)){
+        SaveFrame(Name, NULL, Cam->LastPics[0].DiffMag, DeleteProcessed);
+        Cam->ShedSaved += 1;
+    }else if (DeleteProcessed){
+        unlink(Name);
+    }
+    Cam->ShedSkipped += 1;
+}
 
-        if (strcmp(ThisName, "angle") == 0){
-            // For my hack of panning the camera with a stepper motor.
-            AngleAdjusted = 1;
+//-----------------------------------------------------------------------------------
+// A frame on its way from the directory to being compared.  With "pipeline", frames
+// get read and decoded ahead on decode threads, and then compared in order.
+//-----------------------------------------------------------------------------------
+typedef struct {
+    LastPic_t Pic;
+    DecodeBox_t Plan;   // What to decode, worked out before it goes to a decode thread.
+    int UseDc;          // Just read DC coefficients (dctfilter)
+    int Shed;           // Skipped to catch up, only gets saved.
+    int Tried;          // A decode thread tried to load it, whether that worked or not.
+    int IsLatest;       // Latest frame in the directory.
+}Frame_t;
+
+#define MAX_AHEAD (MAX_THREADS*2)
+static Frame_t Ahead[MAX_AHEAD];    // Used in turn, as frames go through.
+static Queue_t DecodeIn[MAX_THREADS], DecodeOut[MAX_THREADS];
+static int NumDecoders = 0;
+
+//-----------------------------------------------------------------------------------
+// Decode stage, on a decode thread.  Must not look at the camera or its compare
+// context, as the compare stage is using them.  Frames that get decoded fused with
+// comparing only get read here.
+//-----------------------------------------------------------------------------------
+static void DecodeStage(void * Item)
+{
+    Frame_t * Frame = *(Frame_t **)Item;
+    LastPic_t * Pic = &Frame->Pic;
+
+    Pic->File = ReadFileData(Pic->Name);
+    if (Pic->File){
+        if (Frame->UseDc && LoadDcFeatures(Pic->File, Frame->Plan.ScaleDenom, 0, &Pic->Features)){
+            Pic->Loaded = 1;
+        }else if (FusedCompare){
+            return; // Left for LoadPic in the compare stage.
+        }else{
+            Pic->Image = LoadJPEGBox(Pic->File, &Frame->Plan, 0);
+            Pic->Loaded = Pic->Image != NULL;
         }
+        if (!Pic->Loaded){
+            FreeFileData(Pic->File);
+            Pic->File = NULL;
+        }
+    }
+    Frame->Tried = 1;
+}
 
-        l = strlen(ThisName);
-        if (l < 5) continue;
+//-----------------------------------------------------------------------------------
+// Start the decode threads, each with a queue of frames to decode and a queue of
+// decoded frames.
+//-----------------------------------------------------------------------------------
+static void StartPipeline(int NumThreads)
+{
+    for (int a=0;a<NumThreads;a++){
+        QueueInit(&DecodeIn[a], 2, sizeof(Frame_t *));
+        QueueInit(&DecodeOut[a], 2, sizeof(Frame_t *));
+        StartStage(DecodeStage, &DecodeIn[a], &DecodeOut[a]);
+    }
+    NumDecoders = NumThreads;
+    printf("    Pipeline with %d decode threads\n", NumDecoders);
+}
 
-        if (strcmp(FileNames[a].FileName+l-4, ".jpg") != 0 &&
-                strcmp(ThisName+l-5, ".jpeg") != 0){
+//-----------------------------------------------------------------------------------
+// Compare stage: a frame is read (and decoded, unless a decode thread did that).
+// Compare it and figure out if it or the ones before it need saving.
+// Returns 1 if it was processed, 0 if it couldn't be loaded.
+//-----------------------------------------------------------------------------------
+static int CompareFrame(Frame_t * Frame, int DeleteProcessed, int * SawMotion)
+{
+    LastPic_t * NewPic = &Frame->Pic;
+    int Loaded;
 
+    if (Cam->ShedLevel >= 2) Cam->ShedCoarse += 1;
 
-            if (strcmp(ThisName+l-5, ".jpg~") == 0){
-                // Raspistill may leave files ending with '~' around if it was killed
-                // at just the right time.  Remove these files.
-                struct stat statbuf;
-                char * cpn = CatPath(Directory, ThisName);
-                if (stat(cpn, &statbuf) == -1) {
-                    perror(ThisName);
-                    continue;
-                }
-                if (now-statbuf.st_mtime > 5){
-                    fprintf(Log, "rm temp file: %s\n",cpn);
-                    unlink(cpn);
-                }
-            }
-            continue;
+    if (Frame->Tried){
+        Loaded = NewPic->Loaded;
+        // Exif only gets looked at here, as exposure management uses it right away.
+        if (Loaded && ExposureManagementOn) ReadExposureExif(NewPic->File->Data, NewPic->File->Size);
+    }else{
+        // Exif is only needed for exposure management.
+        Loaded = LoadPic(NewPic, &Cam->LastPics[0], ExposureManagementOn);
+    }
+    if (!Loaded){
+        if (access(NewPic->Name, F_OK) != 0){
+            // Already gone.  Can be seen twice if it came in while scanning the directory.
+            return 0;
+        }
+        fprintf(Log, "Failed to load %s\n",NewPic->Name);
+        if (DeleteProcessed){
+            // Raspberry pi timelapse mode may at times dump a corrupt
+            // picture at the end of timelapse mode.  Just delete and go on.
+            unlink(NewPic->Name);
         }
+        return 0;
+    }
+
+    char * ThisName = NewPic->Name+NewPic->nind;
+    if (ThisName[0] == 's' && ThisName[1] == 'f' && ThisName[2] >= '0' && ThisName[2] <= '9'){
+        // Video decomposed files have no meaningful timestamp,
+        // but filename starts with 'sf' and contains unix time minus 1 billion.
+        NewPic->mtime = atoi(ThisName+2) + (time_t)1000000000;
+    }else{
+        NewPic->mtime = (unsigned)NewPic->File->MTime;
+    }
+    LastPic_mtime = NewPic->mtime;
+
+    if (ExposureManagementOn && FollowDir && Frame->IsLatest && time(NULL)-NewPic->mtime <= 1){
+        // Latest image of batch.
+        // Check exposure before comparison, because we may want to restart raspistill ASAP.
+        int d = DecodePic(NewPic, NULL) ? CalcExposureAdjust(NewPic->Image, Cam->Detector) : 0;
+        if (d){
+            //fprintf(Log,"Restart raspistill for exposure adjust\n");
+            relaunch_camera_prog(&Cam->Prog);
+        }
+    }
 
-        strcpy(NewPic.Name, CatPath(Directory, ThisName));
-        NewPic.nind = strlen(Directory)+1;
+    *SawMotion += ProcessImage(NewPic, DeleteProcessed);
+    return 1;
+}
 
+//-----------------------------------------------------------------------------------
+// Make room for more frames in a camera's pending list.
+//-----------------------------------------------------------------------------------
+static void GrowPending(Camera_t * c, int Num)
+{
+    if (Num <= c->PendingAlloc) return;
+    while (c->PendingAlloc < Num) c->PendingAlloc = c->PendingAlloc ? c->PendingAlloc*2 : 32;
+    c->Pending = realloc(c->Pending, sizeof(DirEntry_t)*c->PendingAlloc);
+    if (c->Pending == NULL){
+        fprintf(stderr, "Pending frames malloc failed\n");
+        exit(-1);
+    }
+    COUNT_FRAME_ALLOC();
+}
+
+//-----------------------------------------------------------------------------------
+// Check if a name is that of a frame (ends in ".jpg" or ".jpeg")
+//-----------------------------------------------------------------------------------
+static int IsFrameName(const char * Name)
+{
+    int l = strlen(Name);
+    if (l < 5) return 0;
+    return strcmp(Name+l-4, ".jpg") == 0 || strcmp(Name+l-5, ".jpeg") == 0;
+}
+
+//-----------------------------------------------------------------------------------
+// Compare a file name to a directory entry, for bsearch.
+//-----------------------------------------------------------------------------------
+static int EntryNameCmp(const void * Name, const void * Entry)
+{
+    return strcmp(Name, ((const DirEntry_t *)Entry)->FileName);
+}
 
-        if (strcmp(LastPics[0].Name+LastPics[0].nind, ThisName) == 0
-             || strcmp(LastPics[1].Name+LastPics[1].nind, ThisName) == 0){
-            // Already did this one.
+//-----------------------------------------------------------------------------------
+// Read inotify events for a camera's directory, and add the files they name to its
+// pending list, leaving out ones in Scanned (sorted by name, as GetSortedDir returns
+// them).  If the kernel lost events, the directory needs scanning again.
+//-----------------------------------------------------------------------------------
+static void ReadDirEvents(Camera_t * c, int fd, const DirEntry_t * Scanned, int NumScanned)
+{
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int n = read(fd, buffer, sizeof(buffer));
+    if (!c->Watched) return; // Only used to wake up, the directory gets scanned.
+
+    for (char * p = buffer; p < buffer+n;){
+        struct inotify_event * ev = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW){
+            fprintf(Log, "inotify events lost, scanning directory\n");
+            c->Rescan = 1;
             continue;
         }
+        if (ev->len == 0) continue;
 
-        if (AngleAdjusted){
-            char PanMessage[200];
-            FILE * PanFile;
-            char * FileName = CatPath(Directory, "angle");
-            PanFile = fopen(FileName,"r");
-            PanMessage[fread(PanMessage, 1, 199, PanFile)] = 0;
-            fprintf(Log,"Pan: %s",PanMessage);
-            fclose(PanFile);
-            unlink (FileName);
-            if (DeleteProcessed){
-                unlink(NewPic.Name); //Not using this image, cause it's panned.
-                FileNames[a].FileName[0] = 0;
-                AngleAdjusted = 0;
-            }
-            // Should also reset the motion fatigue map if it's in use, cause everything has now moved.
-            continue;
+        // Only frames and the pan "angle" file, the way the directory scan sees them.
+        if (strlen(ev->name) >= 40) continue;
+        if (strcmp(ev->name, "angle") != 0 && !IsFrameName(ev->name)) continue;
+        if (NumScanned && bsearch(ev->name, Scanned, NumScanned, sizeof(DirEntry_t), EntryNameCmp)){
+            continue; // Sent while the directory got scanned, the scan already found it.
         }
 
-        //printf("use: %s\n",ThisName);
+        GrowPending(c, c->NumPending+1);
+        DirEntry_t * e = &c->Pending[c->NumPending++];
+        memset(e, 0, sizeof(DirEntry_t));
+        strcpy(e->FileName, ev->name);
+        e->MTime = time(NULL);
+    }
+}
 
-        NewPic.Image = LoadJPEG(NewPic.Name, ScaleDenom, 0, 1);
-        if (NewPic.Image == NULL){
-            fprintf(Log, "Failed to load %s\n",NewPic.Name);
-            if (DeleteProcessed){
-                // Raspberry pi timelapse mode may at times dump a corrupt
-                // picture at the end of timelapse mode.  Just delete and go on.
-                unlink(NewPic.Name);
-            }
-            continue;
+//-----------------------------------------------------------------------------------
+// Throw away the events that are waiting, as the directory is about to be scanned.
+//-----------------------------------------------------------------------------------
+static void DrainDirEvents(Camera_t * c)
+{
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    pfd.fd = c->EventFd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)){
+        if (read(c->EventFd, buffer, sizeof(buffer)) <= 0) break;
+    }
+}
+
+//-----------------------------------------------------------------------------------
+// Right after a scan, read the events sent while it ran.  Frames the scan found get
+// left out, so only frames that arrived after it end up pending.  Goes by name, so
+// it doesn't matter what order frames are named in.
+//-----------------------------------------------------------------------------------
+static void ReadScanEvents(Camera_t * c, const DirEntry_t * Scanned, int NumScanned)
+{
+    struct pollfd pfd;
+    pfd.fd = c->EventFd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)){
+        ReadDirEvents(c, c->EventFd, Scanned, NumScanned);
+    }
+}
+
+//-----------------------------------------------------------------------------------
+// Process a whole directory of files, or only the first MaxFrames of them if
+// MaxFrames is not 0.  Cam->Backlog tells if there were more.  If the directory is
+// watched, only the frames inotify reported get processed, without scanning it.
+//-----------------------------------------------------------------------------------
+static int DoDirectoryFunc(char * Directory, int DeleteProcessed, int MaxFrames)
+{
+    DirEntry_t * FileNames;
+    int NumEntries;
+    int a;
+    int SawMotion;
+    int NumProcessed = 0;
+    int NumWaiting = 0;
+    int First = 0, InFlight = 0, NumDecoding = 0;
+    unsigned NumSent = 0, NumTaken = 0;
+    int MaxAhead = NumDecoders ? NumDecoders*2 : 1;
+    int FromEvents = Cam->Watched && !Cam->Rescan;
+
+    SawMotion = 0;
+    Cam->Backlog = 0;
+
+    if (FromEvents){
+        FileNames = Cam->Pending;
+        NumEntries = Cam->NumPending;
+        if (NumEntries == 0) return 0;
+    }else{
+        if (Cam->Watched) DrainDirEvents(Cam);
+        FileNames = GetSortedDir(Directory, &NumEntries);
+        if (FileNames == NULL) return 0;
+        // The scan found everything that events reported so far.
+        Cam->Rescan = 0;
+        Cam->NumPending = 0;
+        if (Cam->Watched) ReadScanEvents(Cam, FileNames, NumEntries);
+        if (NumEntries == 0){
+            FreeDir(FileNames, NumEntries);
+            return 0;
         }
+    }
+    int End = NumEntries;
 
-        if (ThisName[0] == 's' && ThisName[1] == 'f' && ThisName[2] >= '0' && ThisName[2] <= '9'){
-            // Video decomposed files have no meaningful timestamp,
-            // but filename starts with 'sf' and contains unix time minus 1 billion.
-            NewPic.mtime = atoi(ThisName+2) + (time_t)1000000000;
-        }else{
-            struct stat statbuf;
-            if (stat(NewPic.Name, &statbuf) == -1) {
-                perror(NewPic.Name);
-                exit(1);
-            }
-            NewPic.mtime = (unsigned)statbuf.st_mtime;
+    if (FollowDir && (MaxBacklog || MaxLag)){
+        // See if we are falling behind.
+        time_t now = time(NULL);
+        time_t Oldest = now;
+        for (a=0;a<NumEntries;a++){
+            if (!IsWaitingFrame(FileNames[a].FileName)) continue;
+            if (SavePending(CatPath(Directory, FileNames[a].FileName))) continue;
+            NumWaiting += 1;
+            if (FileNames[a].MTime < Oldest) Oldest = FileNames[a].MTime;
         }
-        LastPic_mtime = NewPic.mtime;
+        UpdateShedLevel(NumWaiting, (int)(now-Oldest));
+    }
+
+    a = 0;
+    for (;;){
+        // Queue up frames, as far ahead as the decode threads go.
+        while (a < End && InFlight < MaxAhead){
+            if (MaxFrames && NumProcessed+NumDecoding >= MaxFrames){
+                // Other cameras get a turn first.
+                Cam->Backlog = 1;
+                End = a;
+                break;
+            }
+
+            Frame_t * Frame;
+            LastPic_t * NewPic;
+            char * ThisName;
+            int l;
+            time_t now = time(NULL);
+            int IsLatest = a == NumEntries-1;
+
+            // Check that name ends in ".jpg", ".jpeg"
+            ThisName = FileNames[a++].FileName;
+            if (ThisName[0] == 0) continue; // We already did this one.
+
+            if (strcmp(ThisName, "angle") == 0){
+                // For my hack of panning the camera with a stepper motor.
+                AngleAdjusted = 1;
+            }
+
+            l = strlen(ThisName);
+            if (l < 5) continue;
 
-        if (ExposureManagementOn && FollowDir && a == NumEntries-1 && now-NewPic.mtime <= 1){
-            // Latest image of batch.
-            // Check exposure before comparison, because we may want to restart raspistill ASAP.
-            int d = CalcExposureAdjust(NewPic.Image);
-            if (d){
-                //fprintf(Log,"Restart raspistill for exposure adjust\n");
-                relaunch_camera_prog();
+            if (strcmp(ThisName+l-4, ".jpg") != 0 &&
+                    strcmp(ThisName+l-5, ".jpeg") != 0){
+
+
+                if (strcmp(ThisName+l-5, ".jpg~") == 0){
+                    // Raspistill may leave files ending with '~' around if it was killed
+                    // at just the right time.  Remove these files.
+                    struct stat statbuf;
+                    char * cpn = CatPath(Directory, ThisName);
+                    if (stat(cpn, &statbuf) == -1) {
+                        perror(ThisName);
+                        continue;
+                    }
+                    if (now-statbuf.st_mtime > 5){
+                        fprintf(Log, "rm temp file: %s\n",cpn);
+                        unlink(cpn);
+                    }
+                }
+                continue;
+            }
+
+            Frame = &Ahead[(First+InFlight) % MAX_AHEAD];
+            memset(Frame, 0, sizeof(Frame_t));
+            NewPic = &Frame->Pic;
+            strcpy(NewPic->Name, CatPath(Directory, ThisName));
+            NewPic->nind = strlen(Directory)+1;
+
+
+            if (strcmp(Cam->LastPics[0].Name+Cam->LastPics[0].nind, ThisName) == 0
+                 || strcmp(Cam->LastPics[1].Name+Cam->LastPics[1].nind, ThisName) == 0
+                 || SavePending(NewPic->Name)){
+                // Already did this one.
+                continue;
+            }
+
+            if (AngleAdjusted){
+                char PanMessage[200];
+                FILE * PanFile;
+                char * FileName = CatPath(Directory, "angle");
+                PanFile = fopen(FileName,"r");
+                PanMessage[fread(PanMessage, 1, 199, PanFile)] = 0;
+                fprintf(Log,"Pan: %s",PanMessage);
+                fclose(PanFile);
+                unlink (FileName);
+                if (DeleteProcessed){
+                    unlink(NewPic->Name); //Not using this image, cause it's panned.
+                    ThisName[0] = 0;
+                    AngleAdjusted = 0;
+                }
+                // Should also reset the motion fatigue map if it's in use, cause everything has now moved.
+                continue;
             }
+
+            Frame->IsLatest = IsLatest;
+            if (Cam->ShedLevel && NumWaiting-- % 2 == 0){
+                // Behind.  Only do every other frame, always including the latest one.
+                Frame->Shed = 1;
+            }else if (NumDecoders){
+                // What to decode is worked out now, while the compare context is not in use.
+                PlanDecode(Cam->Detector, Cam->Detector->ScaleDenom, &Frame->Plan);
+                Frame->UseDc = Cam->Detector->DctPercent != 0;
+                Queue_t * In = &DecodeIn[NumSent++ % NumDecoders];
+                *(Frame_t **)QueueSlot(In) = Frame;
+                QueuePush(In);
+                NumDecoding += 1;
+            }
+            InFlight += 1;
         }
 
-        SawMotion += ProcessImage(&NewPic, DeleteProcessed);
-        NumProcessed += 1;
-    }
+        if (InFlight == 0) break;
+
+        // Compare the oldest frame, once it's decoded.
+        Frame_t * Frame = &Ahead[First];
+        First = (First+1) % MAX_AHEAD;
+        InFlight -= 1;
 
-    FreeDir(FileNames, NumEntries); // Free up the whole directory structure.
+        if (Frame->Shed){
+            ShedFrame(Frame->Pic.Name, DeleteProcessed);
+            continue;
+        }
+        if (NumDecoders){
+            Queue_t * Out = &DecodeOut[NumTaken++ % NumDecoders];
+            QueueFront(Out);
+            QueuePop(Out);
+            NumDecoding -= 1;
+        }
+        NumProcessed += CompareFrame(Frame, DeleteProcessed, &SawMotion);
+    }
+    Cam->NumProcessed += NumProcessed;
+
+    if (Cam->Watched){
+        // Frames left for the next turn stay pending, ahead of any new ones.  After a
+        // scan, the new ones are what arrived while it ran.
+        int Left = NumEntries-a;
+        int Newer = FromEvents ? 0 : Cam->NumPending;
+        if (Left){
+            GrowPending(Cam, Left+Newer);
+            memmove(Cam->Pending+Left, Cam->Pending, sizeof(DirEntry_t)*Newer);
+            memmove(Cam->Pending, FileNames+a, sizeof(DirEntry_t)*Left);
+        }
+        Cam->NumPending = Left+Newer;
+    }
+    if (!FromEvents) FreeDir(FileNames, NumEntries); // Free up the whole directory structure.
     FileNames = NULL;
 
-    SinceMotionMs += 1000;
+    static int AllocsShown = -1;
+    int Allocs = __atomic_load_n(&FrameAllocs, __ATOMIC_RELAXED); // Other stages count too.
+    if (Verbosity && NumProcessed && Allocs != AllocsShown){
+        // Should stop going up once running.
+        printf("Frame loop heap allocations so far: %d\n", Allocs);
+        AllocsShown = Allocs;
+    }
+
+    Cam->SinceMotionMs += 1000;
 
     return SawMotion;
 }
 
 //-----------------------------------------------------------------------------------
-// Process a whole directory of jpeg files.
+// On SIGTERM or SIGINT, stop following the directory once the frames in hand are done,
+// so frames waiting to be saved still get saved.  Another one stops right away.
 //-----------------------------------------------------------------------------------
-int DoDirectory(char * Directory)
+static volatile sig_atomic_t StopRequested = 0;
+
+static void RequestStop(int sig)
 {
-    int a;
+    StopRequested = 1;
+    signal(sig, SIG_DFL);
+}
+
+//-----------------------------------------------------------------------------------
+// Process the directories of jpeg files of all cameras.
+//-----------------------------------------------------------------------------------
+int DoDirectory(void)
+{
+    int a = 0, c;
+    struct pollfd pfds[MAX_CAMERAS];
+    time_t LastManage = 0;
     Raspistill_restarted = 0;
 
     if (!FollowDir){
         // Offline mode - just a one shot, no polling.
-        return DoDirectoryFunc(Directory, FollowDir);
+        a = 0;
+        for (c=0;c<NumCameras;c++){
+            SelectCamera(&Cameras[c]);
+            a += DoDirectoryFunc(DoDirName, 0, 0);
+        }
+        FlushSaves();
+        return a;
     }
 
-    int wd, fd;
-    fd = inotify_init();
-    if (fd < 0) perror("inotify_init");
+    for (c=0;c<NumCameras;c++){
+        int wd, fd;
+        SelectCamera(&Cameras[c]);
+        fd = inotify_init();
+        if (fd < 0) perror("inotify_init");
+
+        // raspistill first writes under a temporary file name, ending with "~" then renames.
+        // IN_MOVED_TO triggers when the file is renamed to the final file name.
+        // But when using ffmpeg for the RTSP camera hack, ffmpeg writes the files under
+        // the original name, so IN_CLOSE_WRITE is needed for that.
+        wd = inotify_add_watch( fd, DoDirName, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0){
+            fprintf(Log, "add watch failed\n");
+            return 0;
+        }
+        pfds[c].fd = fd;
+        pfds[c].events = POLLIN;
 
-    // raspistill first writes under a temporary file name, ending with "~" then renames.
-    // IN_MOVED_TO triggers when the file is renamed to the final file name.
-    // But when using ffmpeg for the RTSP camera hack, ffmpeg writes the files under
-    // the original name, so IN_CLOSE_WRITE is needed for that.
-    wd = inotify_add_watch( fd, Directory, IN_CLOSE_WRITE | IN_MOVED_TO);
-    if (wd < 0){
-        fprintf(Log, "add watch failed\n");
-        return 0;
+        // Frames come from the events from now on.  What's there already needs a scan.
+        Cam->EventFd = fd;
+        Cam->Watched = DirEvents;
+        Cam->Rescan = 1;
     }
 
-    for (;;){
-        a = DoDirectoryFunc(Directory, FollowDir);
+    while (!StopRequested){
+        int Backlog = 0;
+
+        // Cameras take turns, so one that is behind doesn't hold up the others.
+        a = 0;
+        for (c=0;c<NumCameras;c++){
+            SelectCamera(&Cameras[c]);
+            a += DoDirectoryFunc(DoDirName, 1, NumCameras > 1 ? FRAMES_PER_TURN : 0);
+            Backlog |= Cam->Backlog;
+        }
         DoMotionRun(a);
 
-        int b = manage_camera_prog(NumProcessed);
-        if (b) Raspistill_restarted = 1;
+        time_t now = time(NULL);
+        if (now != LastManage){
+            // Camera programs get checked on once a second.
+            for (c=0;c<NumCameras;c++){
+                SelectCamera(&Cameras[c]);
+                int b = manage_camera_prog(&Cam->Prog, Cam->NumProcessed);
+                if (b){
+                    Raspistill_restarted = 1;
+                    Cam->Rescan = 1; // May have left a temp file behind.
+                }
+                Cam->NumProcessed = 0;
+            }
+            if (now/60 != LastManage/60) LogSaveStats();
+            LastManage = now;
+        }
         if (LogToFile[0] != '\0') LogFileMaintain(0);
 
-        // Wait for more files to appear.
-        struct pollfd pfd = { fd, POLLIN, 0 };
-        int ret = poll(&pfd, 1, 2000);
+        // Wait for more files to appear, unless some are still waiting.
+        int ret = poll(pfds, NumCameras, Backlog ? 0 : 2000);
+        if (ret < 0 && errno == EINTR) continue;
         if (ret < 0) {
             fprintf(Log, "select failed: %s\n", strerror(errno));
             sleep(1);
@@ -378,16 +891,20 @@ int DoDirectory(char * Directory)
         }
         if (ret == 0){
             // Timeout waiting for a new file.
-            fprintf(Log, "wait file poll() timeout\n");
+            if (!Backlog) fprintf(Log, "wait file poll() timeout\n");
             continue;
         }
 
-        // Read and ignore the event to clear it out.
-        const int EVENT_BUF_LEN = 200;
-        char buffer[EVENT_BUF_LEN];
-        read( fd, buffer, EVENT_BUF_LEN );
+        // Read the events, which tell what frames arrived.
+        for (c=0;c<NumCameras;c++){
+            if (pfds[c].revents & POLLIN) ReadDirEvents(&Cameras[c], pfds[c].fd, NULL, 0);
+        }
     }
 
+    // Stopping.  Finish saving, in order.
+    fprintf(Log, "Stopping, finishing saves\n");
+    FlushSaves();
+    LogSaveStats();
     return a;
 }
 
@@ -417,7 +934,6 @@ int DoDirectoryVideos(char * DirName)
         time_t now;
         int VideoActive = 0;
 
-        NumProcessed = 0;
         alt += 1;
 
         FileNames = GetSortedDir(DirName, &NumEntries);
@@ -467,13 +983,13 @@ int DoDirectoryVideos(char * DirName)
             }
 
             // Now should have some files in temp dir.
-            Saw_motion = DoDirectoryFunc(TempDirName, 1);
+            Saw_motion = DoDirectoryFunc(TempDirName, 1, 0);
             if (Saw_motion){
                 char * DstName;
                 char * Ext;
                 fprintf(Log,"Vid has motion %d\n", Saw_motion);
                 // Make filename, but don't copy the file.
-                DstName = BackupImageFile(VidFileName, Saw_motion,1);
+                DstName = BackupImageFile(VidFileName, NULL, Saw_motion,1);
 
                 Ext = strstr(DstName, ".h264");
                 if (Ext) strcpy(Ext, ".mp4"); // Change xtension to .mp4
@@ -498,15 +1014,17 @@ int DoDirectoryVideos(char * DirName)
         FreeDir(FileNames, NumEntries); // Free up the whole directory structure.
 
         if (FollowDir){
-            int b = manage_camera_prog(VideoActive);
+            int b = manage_camera_prog(&Cam->Prog, VideoActive);
             if (b) Raspistill_restarted = 1;
             if (LogToFile[0] != '\0') LogFileMaintain(0);
+            if (StopRequested) break;
             sleep(1);
         }else{
             break;
         }
 
     }
+    FlushSaves();
     return a;
 }
 
@@ -519,6 +1037,61 @@ static void ScaleRegion (Region_t * Reg, int Denom)
 }
 
 
+//-----------------------------------------------------------------------------------
+// Set up a camera from its settings.
+//-----------------------------------------------------------------------------------
+static void SetupCamera(Camera_t * c, CamConfig_t * Conf)
+{
+    int a;
+    Regions_t * Reg = &Conf->Regions;
+
+    // Adjust region of interest to scale.
+    ScaleRegion(&Reg->DetectReg, ScaleDenom);
+    for (a=0;a<Reg->NumExcludeReg;a++){
+        ScaleRegion(&Reg->ExcludeReg[a], ScaleDenom);
+    }
+
+    c->Conf = Conf;
+    c->SinceMotionPix = 1000;
+    SelectCamera(c);
+
+    if (Conf->Name[0]) printf("Camera '%s'\n", Conf->Name);
+    if (DoDirName[0]) printf("    Source directory = %s, follow=%d\n",DoDirName, FollowDir);
+    if (SaveDir[0]) printf("    Save to dir %s\n",SaveDir);
+
+    if (NumCamConfigs > 1 && !DoDirName[0]){
+        fprintf(stderr, "Camera '%s' needs a followdir or dodir\n", Conf->Name);
+        exit(-1);
+    }
+
+    c->Detector = NewCompareContext();
+
+    if (DiffMapFileName[0]){
+        MemImage_t *MapPic;
+        printf("    Diffmap file: %s\n",DiffMapFileName);
+        if (Regions.DetectReg.x1 || Regions.DetectReg.y1
+                || (Regions.DetectReg.x2 <  100000) || (Regions.DetectReg.y2 < 100000)){
+            fprintf(stderr, "Specify diff map or detect regions, but not both\n");
+            exit(-1);
+        }
+
+        if (Regions.NumExcludeReg){
+            fprintf(stderr, "Specify diff map or exclude regions, but not both\n");
+            exit(-1);
+        }
+
+        MapPic  = LoadJPEG(DiffMapFileName, ScaleDenom, 0, 0);
+        if (MapPic == 0) exit(-1); // error is already reported.
+
+        c->Detector->WeightMap = ProcessDiffMap(MapPic, &c->Detector->Regions);
+        c->Detector->WeightMapFromFile = 1;
+        FreeMemImage(MapPic);
+    }
+
+    // These directories are likely to be on ramdisk, so they may need re-creating.
+    if (FollowDir) EnsurePathExists(DoDirName,0);
+}
+
 //-----------------------------------------------------------------------------------
 // The main program.
 //-----------------------------------------------------------------------------------
@@ -577,47 +1150,40 @@ int main(int argc, char **argv)
 
     if (UdpDest[0]) InitUDP(UdpDest);
 
-    // Adjust region of interest to scale.
-    ScaleRegion(&Regions.DetectReg, ScaleDenom);
-    for (a=0;a<Regions.NumExcludeReg;a++){
-        ScaleRegion(&Regions.ExcludeReg[a], ScaleDenom);
+    SelectDiffKernel();
+    StartWorkers(NumThreads);
+    if (PipelineThreads) StartPipeline(PipelineThreads);
+    if (SaveQueueDepth || PipelineThreads){
+        // Frames only get dropped rather than wait to be saved if asked to, and only
+        // when following a directory.
+        StartSaveThread(SaveQueueDepth ? SaveQueueDepth : 8, SaveDrop && FollowDir);
+        signal(SIGTERM, RequestStop);
+        signal(SIGINT, RequestStop);
     }
 
-    if (DoDirName[0]) printf("    Source directory = %s, follow=%d\n",DoDirName, FollowDir);
-    if (SaveDir[0]) printf("    Save to dir %s\n",SaveDir);
-    if (TimelapseInterval) printf("    Timelapse interval %d seconds\n",TimelapseInterval);
-
-    if (DiffMapFileName[0]){
-        MemImage_t *MapPic;
-        printf("    Diffmap file: %s\n",DiffMapFileName);
-        if (Regions.DetectReg.x1 || Regions.DetectReg.y1
-                || (Regions.DetectReg.x2 <  100000) || (Regions.DetectReg.y2 < 100000)){
-            fprintf(stderr, "Specify diff map or detect regions, but not both\n");
-            exit(-1);
-        }
-
-        if (Regions.NumExcludeReg){
-            fprintf(stderr, "Specify diff map or exclude regions, but not both\n");
-            exit(-1);
-        }
-
-        MapPic  = LoadJPEG(DiffMapFileName, ScaleDenom, 0, 0);
-        if (MapPic == 0) exit(-1); // error is already reported.
-
-        ProcessDiffMap(MapPic);
-        free(MapPic);
+    if (NumCamConfigs == 0){
+        // No camera sections, just the one camera.
+        GetCamConfig(&CamConfigs[0]);
+        NumCamConfigs = 1;
+    }else if (VidMode){
+        fprintf(stderr, "Video mode can't be used with camera sections\n");
+        exit(-1);
     }
 
+    for (a=0;a<NumCamConfigs;a++){
+        SetupCamera(&Cameras[a], &CamConfigs[a]);
+    }
+    NumCameras = NumCamConfigs;
+    SelectCamera(&Cameras[0]);
 
-    // These directories are likely to be on ramdisk, so they may need re-creating.
-    if (FollowDir) EnsurePathExists(DoDirName,0);
+    if (TimelapseInterval) printf("    Timelapse interval %d seconds\n",TimelapseInterval);
     if (TempDirName[0]) EnsurePathExists(TempDirName,0);
 
     if (DoDirName[0] && file_index == argc){
         // if dodir is specified in config file, but files are specified
         // on the command line, do the files instead.
         if (!VidMode){
-            DoDirectory(DoDirName);
+            DoDirectory();
         }else{
             if (TempDirName[0] == 0){
                 fprintf(stderr, "must specify tempdir for video mode\n");
@@ -631,17 +1197,17 @@ int main(int argc, char **argv)
         MemImage_t *pic1, *pic2;
 
         printf("load %s\n",argv[file_index]);
-        pic1 = LoadJPEG(argv[file_index], ScaleDenom, 0, 0);
+        pic1 = LoadJPEG(argv[file_index], ScaleDenom, DecodeColors, 0);
 
         printf("\nload %s\n",argv[file_index+1]);
-        pic2 = LoadJPEG(argv[file_index+1], ScaleDenom, 0, 0);
+        pic2 = LoadJPEG(argv[file_index+1], ScaleDenom, DecodeColors, 0);
 
         if (pic1 && pic2){
             Verbosity = 2;
-            ComparePix(pic1, pic2, 0, 0,"diff.ppm", NULL);
+            ComparePix(Cam->Detector, pic1, pic2, NULL, NULL, 0, 0,"diff.ppm", NULL);
         }
-        free(pic1);
-        free(pic2);
+        FreeMemImage(pic1);
+        FreeMemImage(pic2);
     }else{
         int a;
         MemImage_t * pic;
@@ -650,9 +1216,9 @@ int main(int argc, char **argv)
             printf("input file %s\n",argv[a]);
 
             // Load file into memory.
-            pic = LoadJPEG(argv[a], 4, 0, 1);
+            pic = LoadJPEG(argv[a], 4, DecodeColors, 1);
 
-            CalcExposureAdjust(pic);
+            CalcExposureAdjust(pic, Cam->Detector);
         }
     }
     return 0;
@@ -0,0 +1,158 @@
+//-----------------------------------------------------------------------------------
+// Queues for handing frames from one stage of processing to the next, with each
+// stage running on its own thread.  Reading and decoding frames and saving them
+// can then overlap with comparing.
+//
+// Imgcomp is licensed under GPL v2 (see README.txt)
+//-----------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "imgcomp.h"
+
+//-----------------------------------------------------------------------------------
+// Set up a queue.  Items are kept in the queue's own slots, so once running nothing
+// gets allocated.  Only one thread may put items in, and only one take them out.
+// Head and Tail are each only changed by one of them, so there is no lock.  The
+// semaphores are only there so a stage can sleep while it has nothing to do.
+//-----------------------------------------------------------------------------------
+void QueueInit(Queue_t * Q, int NumSlots, int ItemSize)
+{
+    Q->Slots = calloc(NumSlots, ItemSize);
+    if (Q->Slots == NULL){
+        fprintf(stderr, "Queue malloc failed\n");
+        exit(-1);
+    }
+    Q->NumSlots = NumSlots;
+    Q->ItemSize = ItemSize;
+    Q->Head = Q->Tail = 0;
+    sem_init(&Q->Filled, 0, 0);
+    sem_init(&Q->Free, 0, NumSlots);
+}
+
+//-----------------------------------------------------------------------------------
+// Producer: get the next slot to fill in.  Waits if the queue is full.
+//-----------------------------------------------------------------------------------
+void * QueueSlot(Queue_t * Q)
+{
+    while (sem_wait(&Q->Free)); // Retry if interrupted by a signal.
+    return Q->Slots + (Q->Head % Q->NumSlots) * Q->ItemSize;
+}
+
+//-----------------------------------------------------------------------------------
+// Producer: like QueueSlot, but returns NULL instead of waiting if the queue is full.
+//-----------------------------------------------------------------------------------
+void * QueueTrySlot(Queue_t * Q)
+{
+    if (sem_trywait(&Q->Free)) return NULL;
+    return Q->Slots + (Q->Head % Q->NumSlots) * Q->ItemSize;
+}
+
+//-----------------------------------------------------------------------------------
+// Producer: hand over the slot from QueueSlot.
+//-----------------------------------------------------------------------------------
+void QueuePush(Queue_t * Q)
+{
+    __atomic_store_n(&Q->Head, Q->Head+1, __ATOMIC_RELEASE);
+    sem_post(&Q->Filled);
+}
+
+//-----------------------------------------------------------------------------------
+// Consumer: get the oldest item.  Waits if the queue is empty.  The item stays
+// in the queue until QueuePop, so the producer can still see it.
+//-----------------------------------------------------------------------------------
+void * QueueFront(Queue_t * Q)
+{
+    while (sem_wait(&Q->Filled));
+    return Q->Slots + (Q->Tail % Q->NumSlots) * Q->ItemSize;
+}
+
+//-----------------------------------------------------------------------------------
+// Consumer: done with the item from QueueFront.  Its slot can be filled again.
+//-----------------------------------------------------------------------------------
+void QueuePop(Queue_t * Q)
+{
+    __atomic_store_n(&Q->Tail, Q->Tail+1, __ATOMIC_RELEASE);
+    sem_post(&Q->Free);
+}
+
+//-----------------------------------------------------------------------------------
+// Consumer: number of items waiting after the one from QueueFront.
+//-----------------------------------------------------------------------------------
+int QueueMore(Queue_t * Q)
+{
+    int n;
+    sem_getvalue(&Q->Filled, &n);
+    return n;
+}
+
+//-----------------------------------------------------------------------------------
+// Producer: number of items not done yet, and look at one of them (0 = oldest)
+//-----------------------------------------------------------------------------------
+int QueueCount(Queue_t * Q)
+{
+    return Q->Head - __atomic_load_n(&Q->Tail, __ATOMIC_ACQUIRE);
+}
+
+void * QueueItem(Queue_t * Q, int n)
+{
+    unsigned Index = __atomic_load_n(&Q->Tail, __ATOMIC_ACQUIRE) + n;
+    return Q->Slots + (Index % Q->NumSlots) * Q->ItemSize;
+}
+
+//-----------------------------------------------------------------------------------
+// Producer: wait until the consumer is done with everything in the queue.
+//-----------------------------------------------------------------------------------
+void QueueWaitEmpty(Queue_t * Q)
+{
+    for (int a=0;a<Q->NumSlots;a++){
+        while (sem_wait(&Q->Free));
+    }
+    for (int a=0;a<Q->NumSlots;a++){
+        sem_post(&Q->Free);
+    }
+}
+
+//-----------------------------------------------------------------------------------
+// Stage thread.  Runs Func on each item of its input queue in turn, then passes
+// the item on to its output queue, if it has one.
+//-----------------------------------------------------------------------------------
+typedef struct {
+    StageFunc_t Func;
+    Queue_t * In;
+    Queue_t * Out;
+}Stage_t;
+
+static void * StageThread(void * Arg)
+{
+    Stage_t * Stage = Arg;
+    for (;;){
+        void * Item = QueueFront(Stage->In);
+        Stage->Func(Item);
+        if (Stage->Out){
+            memcpy(QueueSlot(Stage->Out), Item, Stage->Out->ItemSize);
+            QueuePush(Stage->Out);
+        }
+        QueuePop(Stage->In);
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------------
+// Start a thread for a stage.  Out may be NULL for the last stage.
+//-----------------------------------------------------------------------------------
+void StartStage(StageFunc_t Func, Queue_t * In, Queue_t * Out)
+{
+    pthread_t Thread;
+    Stage_t * Stage = malloc(sizeof(Stage_t));
+    Stage->Func = Func;
+    Stage->In = In;
+    Stage->Out = Out;
+    if (pthread_create(&Thread, NULL, StageThread, Stage)){
+        fprintf(stderr, "Could not create stage thread\n");
+        exit(-1);
+    }
+    pthread_detach(Thread);
+}
@@ -23,10 +23,6 @@
 #include "config.h"
 #include "jhead.h"
 
-static int camera_prog_pid = 0;
-
-static char OutNameSeq = 'a';
-
 int relaunch_timeout = 10;
 int give_up_timeout = 20;
 
@@ -85,24 +81,29 @@ static pid_t do_launch_program(char * cmd_string)
 
 //-----------------------------------------------------------------------------------
 // Launch or re-launch raspistill or libcamera-still or libcamera-vid
+// Uses the settings of the current camera.
 //-----------------------------------------------------------------------------------
-int relaunch_camera_prog(void)
+int relaunch_camera_prog(CameraProg_t * Prog)
 {
+    static int KilledLeftover = 0;
+
     // Kill raspistill or libcamera if it's already running.
-    if (camera_prog_pid){
-        kill(camera_prog_pid,SIGKILL);
+    if (Prog->pid){
+        kill(Prog->pid,SIGKILL);
         // If we launched the camera program (raspistill or libcamera), 
 		// need to call wait() so that we dont' accumulate an army of child zombie processes
         int exit_code = 123;
         int a;
         time_t then, now = time(NULL);
-        a = wait(&exit_code);
+        a = waitpid(Prog->pid, &exit_code, 0); // Other cameras have programs running too.
         fprintf(Log,"Child exit code %d, wait returned %d",exit_code, a);
         then = time(NULL);
         fprintf(Log," At %02d:%02d (%d s)\n",(int)(then%3600)/60, (int)(then%60), (int)(then-now));
-    } else {
+    } else if (!KilledLeftover) {
         // kill libcamera or raspistill if it was already launched when we started.
-		// In that case, we don't have a PID for it.
+		// In that case, we don't have a PID for it.  Only done for the first launch,
+		// later ones would kill what was launched for other cameras.
+        KilledLeftover = 1;
 		char KillCmd[100];
 		for (int a=0;a<80;a++){
 			// Search for first space to get capture command name.
@@ -134,8 +135,8 @@ int relaunch_camera_prog(void)
             // No output specified with raspistill command  Add the option,
             // with a different prefix each time so numbers don't overlap.
             int l = strlen(cmd_appended);
-            sprintf(cmd_appended+l," -o %s/out%c%%05d.jpg",DoDirName, OutNameSeq++);
-            if (OutNameSeq >= 'z') OutNameSeq = 'a';
+            if (Prog->OutNameSeq < 'a' || Prog->OutNameSeq >= 'z') Prog->OutNameSeq = 'a';
+            sprintf(cmd_appended+l," -o %s/out%c%%05d.jpg",DoDirName, Prog->OutNameSeq++);
             //fprintf(Log,"Run program: %s\n",cmd_appended);
         }
     }
@@ -143,7 +144,7 @@ int relaunch_camera_prog(void)
         fprintf(stderr, "aquire_cmd was not raspistill, not setting output or exposure settings\n");
     }
 
-    camera_prog_pid = do_launch_program(cmd_appended);
+    Prog->pid = do_launch_program(cmd_appended);
     return 0;
 }
 
@@ -234,48 +235,42 @@ void DoMotionRun(int SawMotion)
 //-----------------------------------------------------------------------------------
 // Manage camera program (libcamera or raspistill) - may need restarting if it dies or brightness changed too much.
 //-----------------------------------------------------------------------------------
-static int MsSinceImage = 0;
-static int MsSinceLaunch = 0;
-static int InitialBrSum;
-static int InitialNumBr;
-static int NumTotalImages;
-
-int manage_camera_prog(int NewImages)
+int manage_camera_prog(CameraProg_t * Prog, int NewImages)
 {
     int timeout;
     time_t now = time(NULL);
 
-    MsSinceImage += 1000;
-    MsSinceLaunch += 1000;
+    Prog->MsSinceImage += 1000;
+    Prog->MsSinceLaunch += 1000;
 
     if (NewImages > 0){
-        MsSinceImage = 0;
-        NumTotalImages += NewImages;
+        Prog->MsSinceImage = 0;
+        Prog->NumTotalImages += NewImages;
     }else{
-        if (MsSinceImage >= 3000){
-            fprintf(Log,"No new images, %d (at %d:%d)\n",MsSinceImage, (int)(now%3600/60), (int)(now%60));
+        if (Prog->MsSinceImage >= 3000){
+            fprintf(Log,"No new images, %d (at %d:%d)\n",Prog->MsSinceImage, (int)(now%3600/60), (int)(now%60));
         }
     }
 
-    if (camera_prog_pid == 0){
+    if (Prog->pid == 0){
         // Camera program has not been launched.
         fprintf(Log,"Initial launch of camera program\n");
         goto force_restart;
     }
 
     timeout = relaunch_timeout * 1000;
-    if (MsSinceImage > timeout){
+    if (Prog->MsSinceImage > timeout){
         // Not getting any images for 5 seconds or vide ofiles for 10.
         // Probably something went wrong with raspistill or raspivid.
-        if (MsSinceLaunch > timeout){
-            if (give_up_timeout && MsSinceImage > give_up_timeout * 1000){
-                if (NumTotalImages >= 5){
+        if (Prog->MsSinceLaunch > timeout){
+            if (give_up_timeout && Prog->MsSinceImage > give_up_timeout * 1000){
+                if (Prog->NumTotalImages >= 5){
 					// sometimes camera system just hangs.  This was rare with raspistill, 
 					// but with libcamera-still it happens more often (about every two months)
-                    fprintf(Log,"Relaunch camera program didn't fix.  Reboot!.  (%d sec since image)\n",MsSinceImage/1000);
+                    fprintf(Log,"Relaunch camera program didn't fix.  Reboot!.  (%d sec since image)\n",Prog->MsSinceImage/1000);
                     // force rotation of log.
                     LogFileMaintain(1);
-                    MsSinceImage = 0; // dummy for now.
+                    Prog->MsSinceImage = 0; // dummy for now.
                     printf("Reboot now\n");   // Requires setuid bit of reboot to be set as reboot
                     int r = system("reboot"); // normally requires root prviledges.
                                               // do "sudo chmod +s /usr/sbin/reboot" so normal process can run it.
@@ -283,13 +278,13 @@ int manage_camera_prog(int NewImages)
                     exit(0);
                 }else{
                     // Less than 5 images.  Probably left over from last run.
-                    fprintf(Log,"Camera program never worked! Give up. %d sec\n",MsSinceImage/1000);
+                    fprintf(Log,"Camera program never worked! Give up. %d sec\n",Prog->MsSinceImage/1000);
                     LogFileMaintain(1);
                     // A reboot wouldn't fix this!
                     exit(0);
                 }
             }else{
-                fprintf(Log,"No images for %d sec.  Relaunch camera program\n",MsSinceImage/1000);
+                fprintf(Log,"No images for %d sec.  Relaunch camera program\n",Prog->MsSinceImage/1000);
                 goto force_restart;
             }
         }
@@ -297,9 +292,9 @@ int manage_camera_prog(int NewImages)
     return 0;
 
 force_restart:
-    relaunch_camera_prog();
-    MsSinceLaunch = 0;
-    InitialBrSum = InitialNumBr = 0;
+    relaunch_camera_prog(Prog);
+    Prog->MsSinceLaunch = 0;
+    Prog->InitialBrSum = Prog->InitialNumBr = 0;
     SinceLightChange = 0;
     return 1;
 }
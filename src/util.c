@@ -4,9 +4,11 @@
 //
 // Imgcomp is licensed under GPL v2 (see README.txt)
 //-----------------------------------------------------------------------------------
+#define _POSIX_C_SOURCE 200809L // For kill and the signal masks, which -std=c99 leaves out.
 #include <stdio.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
@@ -16,6 +18,12 @@
 #include <unistd.h>
 #include <utime.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
 #ifndef PATH_MAX
     #define PATH_MAX 1024
 #endif
@@ -24,7 +32,11 @@
 
 static int BackupImageCount = 0;
 static int CopyFile(char * src, char * dest);
+static int WriteFileData(FileData_t * File, char * dest);
 static void CopyJpgFileCmd(char * src, char * dest);
+static int CoprocSave(char * Name, char * DstPath, int DeleteSrc);
+static void CoprocFinish(void);
+static int CoprocPending(const char * Name);
 
 //-----------------------------------------------------------------------------------
 // Concatenate dir name and file name.  Not thread safe!
@@ -49,6 +61,13 @@ char * CatPath(char *Dir, char * FileName)
 }
 
 
+//--------------------------------------------------------------------------------
+// Last directory that was found or made, so saves into the same directory as the
+// one before only have to stat that directory, not every part of the path.  Per
+// thread, as the save thread and the main thread both make paths.
+//--------------------------------------------------------------------------------
+static __thread char KnownDir[PATH_MAX*2];
+
 //--------------------------------------------------------------------------------
 // Ensure that a path exists
 //--------------------------------------------------------------------------------
@@ -71,6 +90,21 @@ int EnsurePathExists(const char * FileName, int filepath)
             NewPath[a++] = '/';
         }
     }
+    NewPath[a] = 0;
+
+    {
+        int DirLen = a;
+        while (DirLen > 0 && NewPath[DirLen-1] != '/') DirLen--;
+        if (DirLen <= 1) return 1; // No directory, or just the root.
+        NewPath[DirLen-1] = 0;
+        if (strcmp(NewPath, KnownDir) == 0){
+            // Still check it's there, it may have been deleted since.
+            struct stat st;
+            if (stat(NewPath, &st) == 0 && S_ISDIR(st.st_mode)) return 1;
+        }
+        strcpy(KnownDir, NewPath); // Exists by the time we return.
+        NewPath[DirLen-1] = '/';
+    }
     
     for (;;){
         a--;
@@ -131,6 +165,19 @@ static int fncmpfunc (const void * a, const void * b)
     return strcmp(  ((DirEntry_t*)a)->FileName, ((DirEntry_t*)b)->FileName  );
 }
 
+//-----------------------------------------------------------------------------------
+// Directory arrays remember how big they are, and freed ones get kept for the next
+// directory read.  Two, because a directory of videos gets read while its frames are.
+//-----------------------------------------------------------------------------------
+typedef struct {
+    int NumAllocated;
+    DirEntry_t Entries[0];
+}DirBuf_t;
+
+#define DIR_BUF(FileNames) ((DirBuf_t *)((char *)(FileNames) - offsetof(DirBuf_t, Entries)))
+
+static DirBuf_t * SpareDirs[2];
+
 //-----------------------------------------------------------------------------------
 // Read a directory and sort it.
 //-----------------------------------------------------------------------------------
@@ -140,18 +187,28 @@ DirEntry_t * GetSortedDir(char * Directory, int * NumFiles)
     int NumFileNames;
     int NumAllocated;
     DIR * dirp;
+    DirBuf_t * Buf;
 
-    NumAllocated = 10;
-    FileNames = malloc(sizeof (DirEntry_t) * NumAllocated);
-
-    NumFileNames = 0;
-  
     dirp = opendir(Directory);
     if (dirp == NULL){
         fprintf(Log, "could not open dir\n");
         return NULL;
     }
 
+    if (SpareDirs[0]){
+        Buf = SpareDirs[0];
+        SpareDirs[0] = SpareDirs[1];
+        SpareDirs[1] = NULL;
+    }else{
+        Buf = malloc(sizeof(DirBuf_t) + sizeof(DirEntry_t) * 10);
+        Buf->NumAllocated = 10;
+        COUNT_FRAME_ALLOC();
+    }
+    FileNames = Buf->Entries;
+    NumAllocated = Buf->NumAllocated;
+
+    NumFileNames = 0;
+
     for (;;){
         struct dirent * dp;
         struct stat buf;
@@ -166,7 +223,10 @@ DirEntry_t * GetSortedDir(char * Directory, int * NumFiles)
 
         if (NumFileNames >= NumAllocated){
             NumAllocated *= 2;
-            FileNames = realloc(FileNames, sizeof (DirEntry_t) * NumAllocated);
+            Buf = realloc(Buf, sizeof(DirBuf_t) + sizeof (DirEntry_t) * NumAllocated);
+            Buf->NumAllocated = NumAllocated;
+            FileNames = Buf->Entries;
+            COUNT_FRAME_ALLOC();
         }
         l = strlen(dp->d_name);
         if (l >= 40){
@@ -193,7 +253,15 @@ DirEntry_t * GetSortedDir(char * Directory, int * NumFiles)
 //-----------------------------------------------------------------------------------
 void FreeDir(DirEntry_t * FileNames, int NumEntries)
 {
-    free (FileNames);
+    DirBuf_t * Buf = DIR_BUF(FileNames);
+    if (SpareDirs[0] == NULL){
+        SpareDirs[0] = Buf;
+    }else if (SpareDirs[1] == NULL){
+        SpareDirs[1] = Buf;
+    }else{
+        free(Buf);
+        COUNT_FRAME_ALLOC();
+    }
 }
 
 //-----------------------------------------------------------------------------------
@@ -224,10 +292,9 @@ static void DestNameFromTime(char * DestPath, const char * KeepPixDir, time_t Pi
 }
 
 //-----------------------------------------------------------------------------------
-// Back up a photo or video file that is of interest or applies to tiemelapse.
-// Or, if "DoNotCopy" is set, just make sure the directory exists.
+// Work out the name a photo or video file gets backed up under.
 //-----------------------------------------------------------------------------------
-char * BackupImageFile(char * Name, int DiffMag, int DoNotCopy)
+static char * SaveName(char * Name, FileData_t * File, int DiffMag)
 {
     static char DstPath[500];
     static char SuffixChar = ' ';
@@ -237,13 +304,15 @@ char * BackupImageFile(char * Name, int DiffMag, int DoNotCopy)
     struct stat statbuf;    
     time_t mtime;
     
-    if (SaveDir[0] == '\0') return NULL; // Picture saving not enabled.
-    
-    if (stat(Name, &statbuf) == -1) {
-        perror(Name);
-        exit(1);
+    if (File){
+        mtime = File->MTime;
+    }else{
+        if (stat(Name, &statbuf) == -1) {
+            perror(Name);
+            exit(1);
+        }
+        mtime = statbuf.st_mtime;
     }
-    mtime = statbuf.st_mtime;
         
     // Get extension (.jpg or .mp4) of file we started with.
     extension = "\0";
@@ -263,29 +332,242 @@ char * BackupImageFile(char * Name, int DiffMag, int DoNotCopy)
         }
         sprintf(NameSuffix, "%c%04d%s",SuffixChar, DiffMag, extension);
         DestNameFromTime(DstPath, SaveDir, mtime, NameSuffix);
-        EnsurePathExists(DstPath, 1);
-        if (!DoNotCopy){
-            if (CopyJpgCmd[0]){
-                // Apply a command, such as jpegtran to copy the file
-                CopyJpgFileCmd(Name, DstPath);
-            }else{
-                // Just copy it from inside the program.
-                CopyFile(Name, DstPath);
-            }
-        }
     }
     BackupImageCount ++;
     return DstPath;
 }
 
+//-----------------------------------------------------------------------------------
+// Move a file by renaming it, if the save method allows.  Returns 0 if it didn't get
+// moved, such as when it's on another file system, and needs copying instead.
+//-----------------------------------------------------------------------------------
+static int MoveFile(char * src, char * dest)
+{
+    if (SaveMethod != SAVE_MOVE) return 0;
+    return rename(src, dest) == 0;
+}
+
+//-----------------------------------------------------------------------------------
+// Save a losslessly optimized copy of a jpeg, from memory if it was already read.
+//-----------------------------------------------------------------------------------
+static int OptimizedCopy(char * Name, FileData_t * File, char * DstPath)
+{
+    FileData_t * Read = NULL;
+    if (File == NULL){
+        File = Read = ReadFileData(Name);
+        if (File == NULL) return 0;
+    }
+    int Ok = WriteOptimizedJpeg(File, DstPath, OptimizeJpg == 2);
+    if (Ok){
+        struct utimbuf mtime;
+        mtime.actime = File->MTime;
+        mtime.modtime = File->MTime;
+        utime(DstPath, &mtime);
+    }
+    FreeFileData(Read);
+    return Ok;
+}
+
+//-----------------------------------------------------------------------------------
+// Make the backup copy.  If the file was already read into memory (File), the copy
+// gets written from that.  If the file gets deleted after (DeleteSrc), it may get moved
+// instead, or get deleted later by the copy coprocess.  Then 1 is returned.
+//-----------------------------------------------------------------------------------
+static int SaveCopy(char * Name, FileData_t * File, char * DstPath, int DeleteSrc)
+{
+    EnsurePathExists(DstPath, 1);
+    if (CopyJpgCmd[0]){
+        // Apply a command, such as jpegtran to copy the file
+        CopyJpgFileCmd(Name, DstPath);
+    }else if (CopyJpgCoproc[0] && CoprocSave(Name, DstPath, DeleteSrc)){
+        return 1;
+    }else if (OptimizeJpg && OptimizedCopy(Name, File, DstPath)){
+        // Losslessly made smaller.
+    }else if (DeleteSrc && MoveFile(Name, DstPath)){
+        return 1;
+    }else if (File){
+        // Already have it in memory.
+        WriteFileData(File, DstPath);
+    }else{
+        // Just copy it from inside the program.
+        CopyFile(Name, DstPath);
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------------
+// Back up a photo or video file that is of interest or applies to tiemelapse.
+// Or, if "DoNotCopy" is set, just make sure the directory exists.
+//-----------------------------------------------------------------------------------
+char * BackupImageFile(char * Name, FileData_t * File, int DiffMag, int DoNotCopy)
+{
+    char * DstPath;
+
+    if (SaveDir[0] == '\0') return NULL; // Picture saving not enabled.
+
+    DstPath = SaveName(Name, File, DiffMag);
+    if (DoNotCopy){
+        EnsurePathExists(DstPath, 1);
+    }else{
+        SaveCopy(Name, File, DstPath, 0);
+        CoprocFinish();
+    }
+    return DstPath;
+}
 
 //-----------------------------------------------------------------------------------
-// Copy a file from within the program.
+// Saving frames on a thread of its own, so slow writes to flash don't hold up
+// comparing.  Names still get worked out in order, on the main thread.
+//-----------------------------------------------------------------------------------
+typedef struct {
+    char Name[500];
+    char DstPath[500];
+    FileData_t * File;
+    int DeleteSrc;
+    long long Queued;   // Time it was queued, in milliseconds.
+}SaveJob_t;
+
+static Queue_t SaveQueue;
+static int SaveThreadRunning = 0;
+static int DropWhenFull = 0;
+
+// Counts since they were last logged.  Saves get counted on the save thread.
+static int SavesDone, SaveMsTotal, SaveMsMax;
+static int SavesDropped;
+
+static long long NowMs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000LL + tv.tv_usec/1000;
+}
+
+static void SaveStage(void * Item)
+{
+    SaveJob_t * Job = Item;
+    int SrcDone = SaveCopy(Job->Name, Job->File, Job->DstPath, Job->DeleteSrc);
+    FreeFileData(Job->File);
+    if (Job->DeleteSrc && !SrcDone) unlink(Job->Name);
+    // The copy coprocess may work on more at once, but only while more are queued.
+    if (!QueueMore(&SaveQueue)) CoprocFinish();
+
+    int Ms = (int)(NowMs()-Job->Queued);
+    if (Ms < 0) Ms = 0; // Clock got set back.
+    __atomic_add_fetch(&SavesDone, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&SaveMsTotal, Ms, __ATOMIC_RELAXED);
+    int Max = __atomic_load_n(&SaveMsMax, __ATOMIC_RELAXED);
+    while (Ms > Max && !__atomic_compare_exchange_n(&SaveMsMax, &Max, Ms, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+//-----------------------------------------------------------------------------------
+// Start the save thread, with room for Depth frames waiting to be saved.  With
+// Drop set, frames that don't fit get dropped instead of waiting for room.
+//-----------------------------------------------------------------------------------
+void StartSaveThread(int Depth, int Drop)
+{
+    if (SaveThreadRunning) return;
+    QueueInit(&SaveQueue, Depth, sizeof(SaveJob_t));
+    StartStage(SaveStage, &SaveQueue, NULL);
+    DropWhenFull = Drop;
+    SaveThreadRunning = 1;
+    printf("    Saving frames on a thread, queue of %d\n", Depth);
+}
+
+//-----------------------------------------------------------------------------------
+// Save a frame like BackupImageFile, on the save thread if it's running.  Takes over
+// File.  The frame gets deleted once it's saved if DeleteSrc is set.
+//-----------------------------------------------------------------------------------
+void SaveFrame(char * Name, FileData_t * File, int DiffMag, int DeleteSrc)
+{
+    if (SaveThreadRunning && SaveDir[0]){
+        SaveJob_t * Job = DropWhenFull ? QueueTrySlot(&SaveQueue) : QueueSlot(&SaveQueue);
+        if (Job == NULL){
+            // Saving can't keep up.  Don't hold up comparing for it.
+            fprintf(Log, "Save queue full, dropped %s\n", Name);
+            SavesDropped += 1;
+            FreeFileData(File);
+            if (DeleteSrc) unlink(Name);
+            return;
+        }
+        strcpy(Job->Name, Name);
+        strcpy(Job->DstPath, SaveName(Name, File, DiffMag));
+        Job->File = File;
+        Job->DeleteSrc = DeleteSrc;
+        Job->Queued = NowMs();
+        QueuePush(&SaveQueue);
+        return;
+    }
+    int SrcDone = 0;
+    if (SaveDir[0]) SrcDone = SaveCopy(Name, File, SaveName(Name, File, DiffMag), DeleteSrc);
+    FreeFileData(File);
+    if (DeleteSrc && !SrcDone) unlink(Name);
+    CoprocFinish();
+}
+
+//-----------------------------------------------------------------------------------
+// Check if a frame is still waiting to be saved (and deleted).
+//-----------------------------------------------------------------------------------
+int SavePending(const char * Name)
+{
+    if (!SaveThreadRunning) return 0;
+    if (CoprocPending(Name)) return 1;
+    int n = QueueCount(&SaveQueue);
+    for (int a=0;a<n;a++){
+        SaveJob_t * Job = QueueItem(&SaveQueue, a);
+        if (strcmp(Job->Name, Name) == 0) return 1;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------------
+// Wait for all frames to be saved.
+//-----------------------------------------------------------------------------------
+void FlushSaves(void)
+{
+    if (!SaveThreadRunning) return;
+    QueueWaitEmpty(&SaveQueue);
+}
+
+//-----------------------------------------------------------------------------------
+// Log how many frames got saved and dropped, and how long saving took from when
+// they were queued, since the last time this was called.
+//-----------------------------------------------------------------------------------
+void LogSaveStats(void)
+{
+    if (!SaveThreadRunning) return;
+    int Done = __atomic_exchange_n(&SavesDone, 0, __ATOMIC_RELAXED);
+    int MsTotal = __atomic_exchange_n(&SaveMsTotal, 0, __ATOMIC_RELAXED);
+    int MsMax = __atomic_exchange_n(&SaveMsMax, 0, __ATOMIC_RELAXED);
+    if (Done == 0 && SavesDropped == 0) return;
+
+    fprintf(Log, "Saved %d frames, %d dropped, latency avg %d max %d ms, %d queued\n",
+            Done, SavesDropped, Done ? MsTotal/Done : 0, MsMax, QueueCount(&SaveQueue));
+    SavesDropped = 0;
+}
+
+
+//-----------------------------------------------------------------------------------
+// Open a file to copy to.  Makes its directory again if it went away since the last
+// time a file was saved in it.
+//-----------------------------------------------------------------------------------
+static int OpenDest(char * dest)
+{
+    int fd = open(dest, O_CREAT | O_WRONLY | O_TRUNC, 0x1ff);
+    if (fd == -1 && errno == ENOENT){
+        KnownDir[0] = 0;
+        EnsurePathExists(dest, 1);
+        fd = open(dest, O_CREAT | O_WRONLY | O_TRUNC, 0x1ff);
+    }
+    return fd;
+}
+
+//-----------------------------------------------------------------------------------
+// Copy a file from within the program.  Returns -1 if the source is gone, such as
+// a frame that was already deleted.
 //-----------------------------------------------------------------------------------
 static int CopyFile(char * src, char * dest)
 {
-    int inputFd, outputFd, openFlags;
-    int filePerms;
+    int inputFd, outputFd;
     struct stat statbuf;
     size_t numRead;
     #define BUF_SIZE 8192
@@ -298,19 +580,23 @@ static int CopyFile(char * src, char * dest)
     inputFd = open(src, O_RDONLY, 0);
     if (inputFd == -1){
         fprintf(Log,"CopyFile could not open src %s\n",src);
-        exit(-1);
+        return -1;
     }
  
-    openFlags = O_CREAT | O_WRONLY | O_TRUNC;
-
-    filePerms = 0x1ff;
-
-    outputFd = open(dest, openFlags, filePerms);
+    outputFd = OpenDest(dest);
     if (outputFd == -1){
         fprintf(Log,"CopyFile could not open dest %s\n",dest);
         exit(-1);
     }
 
+    if (SaveMethod != SAVE_COPY){
+        // Copy in the kernel, without reading it in here.
+        off_t Offset = 0;
+        while (sendfile(outputFd, inputFd, &Offset, 1<<20) > 0);
+        // Whatever sendfile couldn't copy gets copied below.
+        lseek(inputFd, Offset, SEEK_SET);
+    }
+
     // Transfer data until we encounter end of input or an error
  
     for(;;){
@@ -339,6 +625,124 @@ static int CopyFile(char * src, char * dest)
     return 0;
 }
 
+//-----------------------------------------------------------------------------------
+// Write a file that was read into memory back out under another name.
+//-----------------------------------------------------------------------------------
+static int WriteFileData(FileData_t * File, char * dest)
+{
+    int outputFd = OpenDest(dest);
+    if (outputFd == -1){
+        fprintf(Log,"WriteFileData could not open dest %s\n",dest);
+        exit(-1);
+    }
+    if (write(outputFd, File->Data, File->Size) != File->Size){
+        fprintf(Log,"write error to %s",dest);
+        exit(-1);
+    }
+    close(outputFd);
+
+    {
+        struct utimbuf mtime;
+        mtime.actime = File->MTime;
+        mtime.modtime = File->MTime;
+        utime(dest, &mtime);
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------------
+// Buffers of files that were freed get kept for reuse, like image buffers.
+//-----------------------------------------------------------------------------------
+#define MAX_SPARE_FILES 4
+static FileData_t * SpareFiles[MAX_SPARE_FILES];
+static int NumSpareFiles = 0;
+static pthread_mutex_t SpareLock = PTHREAD_MUTEX_INITIALIZER; // Decode and save threads use them too.
+
+//-----------------------------------------------------------------------------------
+// Read a whole file into memory with one read.  Returns NULL if it can't be read.
+//-----------------------------------------------------------------------------------
+FileData_t * ReadFileData(char * FileName)
+{
+    struct stat statbuf;
+    FileData_t * File;
+    int fd = open(FileName, O_RDONLY, 0);
+    if (fd == -1){
+        fprintf(Log, "Could not open file: \"%s\"!\n", FileName);
+        return NULL;
+    }
+    if (fstat(fd, &statbuf) == -1){
+        perror(FileName);
+        close(fd);
+        return NULL;
+    }
+    int Size = statbuf.st_size;
+
+    // Use the smallest spare buffer that's big enough, or grow the biggest one.
+    FileData_t * Old = NULL;
+    File = NULL;
+    pthread_mutex_lock(&SpareLock);
+    int best = -1, biggest = -1;
+    for (int a=0;a<NumSpareFiles;a++){
+        int b = SpareFiles[a]->BufSize;
+        if (b >= Size && (best < 0 || b < SpareFiles[best]->BufSize)) best = a;
+        if (biggest < 0 || b > SpareFiles[biggest]->BufSize) biggest = a;
+    }
+    if (best >= 0){
+        File = SpareFiles[best];
+        SpareFiles[best] = SpareFiles[--NumSpareFiles];
+    }else if (biggest >= 0){
+        Old = SpareFiles[biggest];
+        SpareFiles[biggest] = SpareFiles[--NumSpareFiles];
+    }
+    pthread_mutex_unlock(&SpareLock);
+
+    if (File == NULL){
+        // Leave some room, as the next frame is likely to be a bit bigger.
+        int BufSize = Size + Size/4;
+        File = realloc(Old, sizeof(FileData_t)+BufSize);
+        if (File == NULL){
+            fprintf(Log, "File buffer malloc failed");
+            free(Old);
+            close(fd);
+            return NULL;
+        }
+        File->BufSize = BufSize;
+        COUNT_FRAME_ALLOC();
+    }
+
+    int got = 0;
+    while (got < Size){
+        int n = read(fd, File->Data+got, Size-got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+
+    strncpy(File->Name, FileName, sizeof(File->Name)-1);
+    File->Name[sizeof(File->Name)-1] = '\0';
+    File->MTime = statbuf.st_mtime;
+    File->Size = got;
+    return File;
+}
+
+//-----------------------------------------------------------------------------------
+// Done with a file.  Keep the buffer for the next one.
+//-----------------------------------------------------------------------------------
+void FreeFileData(FileData_t * File)
+{
+    if (File == NULL) return;
+    pthread_mutex_lock(&SpareLock);
+    if (NumSpareFiles < MAX_SPARE_FILES){
+        SpareFiles[NumSpareFiles++] = File;
+        File = NULL;
+    }
+    pthread_mutex_unlock(&SpareLock);
+    if (File){
+        free(File);
+        COUNT_FRAME_ALLOC();
+    }
+}
+
 //-----------------------------------------------------------------------------------
 // Copy file by shell command, so that jpegtran can be used to optimize the file.
 //-----------------------------------------------------------------------------------
@@ -390,6 +794,255 @@ static void CopyJpgFileCmd(char * src, char * dest)
     }
 }
 
+//-----------------------------------------------------------------------------------
+// Copy coprocess.  Instead of running copyjpgcmd for every image, a converter gets
+// started once, and is sent "input<tab>output" lines.  It answers each one with a line
+// when it's done with it, in order.  Answers starting with "err" mean it failed.
+// Up to CoprocWindow images can be sent before waiting for answers.  Runs on the save
+// thread, if there is one.  Source files get deleted once the converter is done.
+// A converter that hangs gets killed, so that saving (and with it, comparing, once
+// the save queue is full) can't be held up for longer than COPROC_TIMEOUT_MS.
+//-----------------------------------------------------------------------------------
+#define COPROC_TIMEOUT_MS 30000 // Longest to wait for an answer.
+#define COPROC_HOLDOFF_MS 60000 // How long to copy instead after giving up on the converter.
+
+typedef struct {
+    char Name[500];
+    char DstPath[500];
+    int DeleteSrc;
+}CoprocJob_t;
+
+static CoprocJob_t CoprocJobs[MAX_COPROC_WINDOW];
+static int CoprocFirst = 0, CoprocNum = 0;
+static pthread_mutex_t CoprocLock = PTHREAD_MUTEX_INITIALIZER; // For CoprocPending.
+static pid_t CoprocPid = 0;
+static int CoprocIn = -1, CoprocOut = -1;
+static char CoprocReply[1000];
+static int CoprocReplyLen = 0;
+static int CoprocFresh = 0; // Restarted, and hasn't answered anything yet.
+static long long CoprocHoldoff = 0; // Don't start it again before this time (ms).
+
+static int StartCoproc(void)
+{
+    int In[2], Out[2];
+    if (pipe(In)) return 0;
+    if (pipe(Out)){
+        close(In[0]);
+        close(In[1]);
+        return 0;
+    }
+    CoprocPid = fork();
+    if (CoprocPid == -1){
+        fprintf(Log, "Failed to fork off copy coprocess\n");
+        CoprocPid = 0;
+        close(In[0]); close(In[1]); close(Out[0]); close(Out[1]);
+        return 0;
+    }
+    if (CoprocPid == 0){
+        // Child takes this branch.  Own process group, so what the shell starts can be
+        // killed along with it.
+        setpgid(0, 0);
+        dup2(In[0], 0);
+        dup2(Out[1], 1);
+        close(In[0]); close(In[1]); close(Out[0]); close(Out[1]);
+        execl("/bin/sh", "sh", "-c", CopyJpgCoproc, (char *)NULL);
+        _exit(127);
+    }
+    setpgid(CoprocPid, CoprocPid); // In case the child didn't get to it yet.
+    close(In[0]);
+    close(Out[1]);
+    CoprocIn = In[1];
+    CoprocOut = Out[0];
+    // Don't let the camera program and other commands hold on to the pipes.
+    fcntl(CoprocIn, F_SETFD, FD_CLOEXEC);
+    fcntl(CoprocOut, F_SETFD, FD_CLOEXEC);
+    CoprocReplyLen = 0;
+    fprintf(Log, "Started copy coprocess: %s\n", CopyJpgCoproc);
+    return 1;
+}
+
+static void StopCoproc(void)
+{
+    if (CoprocPid == 0) return;
+    close(CoprocIn);
+    close(CoprocOut);
+    kill(-CoprocPid, SIGKILL);
+    waitpid(CoprocPid, NULL, 0);
+    CoprocPid = 0;
+}
+
+static int SendCoproc(CoprocJob_t * Job)
+{
+    char Line[1010];
+    int Len = snprintf(Line, sizeof(Line), "%s\t%s\n", Job->Name, Job->DstPath);
+
+    // A converter that died shows up as EPIPE, instead of the SIGPIPE killing us.
+    // SIGPIPE only gets blocked around this write, so the camera program and other
+    // commands still get started with it as it was.
+    sigset_t Pipe, Old;
+    sigemptyset(&Pipe);
+    sigaddset(&Pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &Pipe, &Old);
+    int Ok = write(CoprocIn, Line, Len) == Len;
+    if (!Ok && errno == EPIPE){
+        // Take the SIGPIPE the write raised, so it doesn't go off once unblocked.
+        struct timespec Zero = {0, 0};
+        sigtimedwait(&Pipe, NULL, &Zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &Old, NULL);
+    return Ok;
+}
+
+//-----------------------------------------------------------------------------------
+// Wait for the next answer line.  Returns 0 if the converter went away, -1 if it
+// didn't answer within COPROC_TIMEOUT_MS.
+//-----------------------------------------------------------------------------------
+static int ReadCoproc(void)
+{
+    long long Deadline = NowMs()+COPROC_TIMEOUT_MS;
+    for (;;){
+        char * End = memchr(CoprocReply, '\n', CoprocReplyLen);
+        if (End){
+            *End = '\0';
+            return 1;
+        }
+        if (CoprocReplyLen >= sizeof(CoprocReply)-1) CoprocReplyLen = 0; // Too long, skip it.
+
+        struct pollfd pfd = {CoprocOut, POLLIN, 0};
+        long long Left = Deadline-NowMs();
+        if (Left <= 0) return -1;
+        int r = poll(&pfd, 1, (int)Left);
+        if (r < 0 && errno == EINTR) continue;
+        if (r == 0) return -1;
+
+        int n = read(CoprocOut, CoprocReply+CoprocReplyLen, sizeof(CoprocReply)-1-CoprocReplyLen);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        CoprocReplyLen += n;
+    }
+}
+
+//-----------------------------------------------------------------------------------
+// Done with the oldest job, one way or another.
+//-----------------------------------------------------------------------------------
+static void CoprocDone(int Failed)
+{
+    CoprocJob_t * Job = &CoprocJobs[CoprocFirst];
+    if (Failed){
+        // Still save the image, just not converted.  If it's gone by now, skip it.
+        if (CopyFile(Job->Name, Job->DstPath)){
+            fprintf(Log, "Could not save %s\n", Job->Name);
+        }
+    }
+    if (Job->DeleteSrc) unlink(Job->Name);
+
+    pthread_mutex_lock(&CoprocLock);
+    CoprocFirst = (CoprocFirst+1) % MAX_COPROC_WINDOW;
+    CoprocNum -= 1;
+    pthread_mutex_unlock(&CoprocLock);
+}
+
+//-----------------------------------------------------------------------------------
+// Give up on the converter.  Copy what it hadn't answered yet, and images saved in
+// the next COPROC_HOLDOFF_MS, instead.
+//-----------------------------------------------------------------------------------
+static void CoprocCopyInstead(const char * Why)
+{
+    StopCoproc();
+    fprintf(Log, "Copy coprocess %s, copying %d images and the next %d seconds of images instead\n",
+        Why, CoprocNum, COPROC_HOLDOFF_MS/1000);
+    while (CoprocNum) CoprocDone(1);
+    CoprocFresh = 0;
+    CoprocHoldoff = NowMs()+COPROC_HOLDOFF_MS;
+}
+
+//-----------------------------------------------------------------------------------
+// The converter died.  Restart it and send it what it hadn't answered yet.  If it
+// died again before answering anything, just copy those instead.
+//-----------------------------------------------------------------------------------
+static void RestartCoproc(void)
+{
+    StopCoproc();
+    if (!CoprocFresh && StartCoproc()){
+        fprintf(Log, "Copy coprocess died, restarted it\n");
+        CoprocFresh = 1;
+        int a;
+        for (a=0;a<CoprocNum;a++){
+            if (!SendCoproc(&CoprocJobs[(CoprocFirst+a) % MAX_COPROC_WINDOW])) break;
+        }
+        if (a == CoprocNum) return;
+    }
+    CoprocCopyInstead("keeps dying");
+}
+
+//-----------------------------------------------------------------------------------
+// Wait for the converter to answer the oldest job.
+//-----------------------------------------------------------------------------------
+static void WaitCoproc(void)
+{
+    int Got = ReadCoproc();
+    if (Got < 0){
+        CoprocCopyInstead("isn't answering");
+        return;
+    }
+    if (Got == 0){
+        RestartCoproc();
+        return;
+    }
+    CoprocFresh = 0;
+    int Failed = strncmp(CoprocReply, "err", 3) == 0;
+    if (Failed){
+        fprintf(Log, "Copy coprocess failed on %s: %s\n", CoprocJobs[CoprocFirst].Name, CoprocReply);
+    }
+    int Used = strlen(CoprocReply)+1;
+    CoprocReplyLen -= Used;
+    memmove(CoprocReply, CoprocReply+Used, CoprocReplyLen);
+    CoprocDone(Failed);
+}
+
+//-----------------------------------------------------------------------------------
+// Hand an image to the converter.  Returns 0 if the converter couldn't be started,
+// or was given up on a short while ago.
+//-----------------------------------------------------------------------------------
+static int CoprocSave(char * Name, char * DstPath, int DeleteSrc)
+{
+    if (CoprocPid == 0 && (NowMs() < CoprocHoldoff || !StartCoproc())) return 0;
+    while (CoprocNum >= CoprocWindow) WaitCoproc();
+
+    pthread_mutex_lock(&CoprocLock);
+    CoprocJob_t * Job = &CoprocJobs[(CoprocFirst+CoprocNum) % MAX_COPROC_WINDOW];
+    strcpy(Job->Name, Name);
+    strcpy(Job->DstPath, DstPath);
+    Job->DeleteSrc = DeleteSrc;
+    CoprocNum += 1;
+    pthread_mutex_unlock(&CoprocLock);
+
+    if (!SendCoproc(Job)) RestartCoproc();
+    return 1;
+}
+
+//-----------------------------------------------------------------------------------
+// Wait for the converter to be done with everything it was sent.
+//-----------------------------------------------------------------------------------
+static void CoprocFinish(void)
+{
+    while (CoprocNum) WaitCoproc();
+}
+
+//-----------------------------------------------------------------------------------
+// Check if the converter still has an image that's to be deleted after.
+//-----------------------------------------------------------------------------------
+static int CoprocPending(const char * Name)
+{
+    int Found = 0;
+    pthread_mutex_lock(&CoprocLock);
+    for (int a=0;a<CoprocNum;a++){
+        if (strcmp(CoprocJobs[(CoprocFirst+a) % MAX_COPROC_WINDOW].Name, Name) == 0) Found = 1;
+    }
+    pthread_mutex_unlock(&CoprocLock);
+    return Found;
+}
+
 
 //-----------------------------------------------------------------------------------
 // Open and / or rotate logfiles
@@ -421,10 +1074,13 @@ void LogFileMaintain(int ForceLogSaveReboot)
                     printf("Log rotate %s --> %s\n", ThisLogTo, NewLogTo);
                     fprintf(Log,"Log rotate %s --> %s\n", ThisLogTo, NewLogTo);
                     EnsurePathExists(ThisLogTo, 1);
+                    FlushSaves(); // Save thread may still write to the log.
                     fclose(Log);
                     Log = NULL;
-                    CopyFile(LogToFile, ThisLogTo);
-                    unlink(LogToFile);
+                    if (!MoveFile(LogToFile, ThisLogTo)){
+                        CopyFile(LogToFile, ThisLogTo);
+                        unlink(LogToFile);
+                    }
                     BackupImageCount = 0;
                 }else{
                     fprintf(Log,"Skip log rotate to %s (no images were saved in dir)\n", NewLogTo);
@@ -0,0 +1,112 @@
+//-----------------------------------------------------------------------------------
+// Worker thread pool for splitting image comparison into bands of rows,
+// so the other cores of a Raspberry Pi don't sit idle while comparing.
+//
+// Imgcomp is licensed under GPL v2 (see README.txt)
+//-----------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "imgcomp.h"
+
+int NumBands = 1;   // Number of bands work gets split into (workers plus main thread)
+
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WorkCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t DoneCond = PTHREAD_COND_INITIALIZER;
+
+static BandFunc_t JobFunc;
+static void * JobArg;
+static unsigned JobGeneration = 0;
+static int JobsPending = 0;
+
+//-----------------------------------------------------------------------------------
+// Each worker runs one band of each job, then waits for the next one.
+//-----------------------------------------------------------------------------------
+static void * WorkerThread(void * Arg)
+{
+    int Band = (int)(intptr_t)Arg;
+    unsigned SeenGeneration = 0;
+
+    for (;;){
+        BandFunc_t Func;
+        void * FuncArg;
+
+        pthread_mutex_lock(&PoolLock);
+        while (JobGeneration == SeenGeneration){
+            pthread_cond_wait(&WorkCond, &PoolLock);
+        }
+        SeenGeneration = JobGeneration;
+        Func = JobFunc;
+        FuncArg = JobArg;
+        pthread_mutex_unlock(&PoolLock);
+
+        Func(FuncArg, Band, NumBands);
+
+        pthread_mutex_lock(&PoolLock);
+        if (--JobsPending == 0) pthread_cond_signal(&DoneCond);
+        pthread_mutex_unlock(&PoolLock);
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------------
+// Start worker threads.  The main thread does one of the bands itself.
+//-----------------------------------------------------------------------------------
+void StartWorkers(int NumThreads)
+{
+    if (NumBands > 1) return; // Already started.
+    if (NumThreads > MAX_THREADS) NumThreads = MAX_THREADS;
+
+    for (int a=1;a<NumThreads;a++){
+        pthread_t Thread;
+        if (pthread_create(&Thread, NULL, WorkerThread, (void *)(intptr_t)a)){
+            fprintf(stderr, "Could not create worker thread\n");
+            break;
+        }
+        pthread_detach(Thread);
+        NumBands = a+1;
+    }
+    if (NumBands > 1) printf("    Using %d threads for comparing\n", NumBands);
+}
+
+//-----------------------------------------------------------------------------------
+// Run Func over all bands and wait for all of them to finish.
+//-----------------------------------------------------------------------------------
+void RunBands(BandFunc_t Func, void * Arg)
+{
+    if (NumBands <= 1){
+        Func(Arg, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&PoolLock);
+    JobFunc = Func;
+    JobArg = Arg;
+    JobsPending = NumBands-1;
+    JobGeneration += 1;
+    pthread_cond_broadcast(&WorkCond);
+    pthread_mutex_unlock(&PoolLock);
+
+    Func(Arg, 0, NumBands);
+
+    pthread_mutex_lock(&PoolLock);
+    while (JobsPending){
+        pthread_cond_wait(&DoneCond, &PoolLock);
+    }
+    pthread_mutex_unlock(&PoolLock);
+}
+
+//-----------------------------------------------------------------------------------
+// Get the part of a region that a band covers.  Bands are whole rows.
+//-----------------------------------------------------------------------------------
+Region_t BandRegion(Region_t Reg, int Band, int NumBands)
+{
+    int rows = Reg.y2-Reg.y1;
+    Region_t Ret = Reg;
+    Ret.y1 = Reg.y1 + rows*Band/NumBands;
+    Ret.y2 = Reg.y1 + rows*(Band+1)/NumBands;
+    return Ret;
+}